@@ -0,0 +1,597 @@
+/*
+ * Fledge "email" notification plugin.
+ *
+ * Process wide delivery engine shared by all plugin instances.
+ *
+ * Copyright (c) 2026 Dianomic Systems
+ *
+ * Released under the Apache 2.0 Licence
+ *
+ */
+#include <delivery_engine.h>
+#include <logger.h>
+#include <cstring>
+#include <cstdio>
+
+using namespace std;
+
+std::mutex	DeliveryEngine::m_instanceMutex;
+DeliveryEngine	*DeliveryEngine::m_instance = NULL;
+unsigned int	DeliveryEngine::m_refCount = 0;
+
+/**
+ * Return the shared delivery engine, creating it on first use.
+ * Each call must be balanced by a call to release().
+ */
+DeliveryEngine *DeliveryEngine::acquire()
+{
+	lock_guard<mutex> guard(m_instanceMutex);
+	if (m_instance == NULL)
+	{
+		m_instance = new DeliveryEngine();
+	}
+	m_refCount++;
+	return m_instance;
+}
+
+/**
+ * Drop a reference to the shared delivery engine, the engine
+ * is destroyed when the last plugin instance releases it.
+ */
+void DeliveryEngine::release()
+{
+	lock_guard<mutex> guard(m_instanceMutex);
+	if (m_refCount == 0)
+	{
+		return;
+	}
+	if (--m_refCount == 0)
+	{
+		delete m_instance;
+		m_instance = NULL;
+	}
+}
+
+/**
+ * Construct the engine and start the worker threads
+ */
+DeliveryEngine::DeliveryEngine() : m_shutdown(false), m_readyHead(NULL), m_readyTail(NULL)
+{
+	// curl_global_init is not thread safe, do it once before any worker
+	// runs. It is reference counted by libcurl and the global state is
+	// shared with the rest of the process, so it is never cleaned up here.
+	curl_global_init(CURL_GLOBAL_DEFAULT);
+
+	for (int i = 0; i < DELIVERY_WORKERS; i++)
+	{
+		m_workers.push_back(thread(&DeliveryEngine::worker, this));
+	}
+	Logger::getLogger()->info("Email delivery engine started with %d workers", DELIVERY_WORKERS);
+}
+
+/**
+ * Stop the worker threads, each closes its cached connections
+ */
+DeliveryEngine::~DeliveryEngine()
+{
+	{
+		lock_guard<mutex> guard(m_mutex);
+		m_shutdown = true;
+	}
+	m_cv.notify_all();
+	for (auto& t : m_workers)
+	{
+		t.join();
+	}
+	Logger::getLogger()->info("Email delivery engine stopped");
+}
+
+/**
+ * Queue a message for delivery and wait for the outcome
+ *
+ * @param queue		The queue of the plugin instance submitting the message
+ * @param emailCfg	The configuration to use for the delivery
+ * @param subject	The rendered subject
+ * @param msg		The rendered message body
+ * @return		The curl result code of the delivery
+ */
+int DeliveryEngine::submit(DeliveryQueue *queue, const EmailCfg *emailCfg,
+		const char *subject, const char *msg)
+{
+	DeliveryJob job(emailCfg, subject, msg);
+
+	unique_lock<mutex> lck(m_mutex);
+	if (m_shutdown)
+	{
+		return CURLE_FAILED_INIT;
+	}
+	if (queue->m_tail)
+	{
+		queue->m_tail->m_next = &job;
+	}
+	else
+	{
+		queue->m_head = &job;
+	}
+	queue->m_tail = &job;
+	if (!queue->m_ready)
+	{
+		// Join the round robin of queues with work waiting
+		queue->m_ready = true;
+		queue->m_nextReady = NULL;
+		if (m_readyTail)
+			m_readyTail->m_nextReady = queue;
+		else
+			m_readyHead = queue;
+		m_readyTail = queue;
+	}
+	m_cv.notify_one();
+
+	job.m_cv.wait(lck, [&job]{ return job.m_done; });
+	return job.m_result;
+}
+
+/**
+ * Take the next job, serving the plugin instances with pending
+ * messages in round robin order. Called with m_mutex held.
+ */
+DeliveryJob *DeliveryEngine::nextJob()
+{
+	DeliveryQueue *queue = m_readyHead;
+	m_readyHead = queue->m_nextReady;
+	if (m_readyHead == NULL)
+	{
+		m_readyTail = NULL;
+	}
+	queue->m_nextReady = NULL;
+
+	DeliveryJob *job = queue->m_head;
+	queue->m_head = job->m_next;
+	job->m_next = NULL;
+	if (queue->m_head == NULL)
+	{
+		queue->m_tail = NULL;
+		queue->m_ready = false;
+	}
+	else
+	{
+		// Go to the back of the round robin
+		if (m_readyTail)
+			m_readyTail->m_nextReady = queue;
+		else
+			m_readyHead = queue;
+		m_readyTail = queue;
+	}
+	return job;
+}
+
+/**
+ * Worker thread body
+ */
+void DeliveryEngine::worker()
+{
+	WorkerArena arena;
+
+	unique_lock<mutex> lck(m_mutex);
+	while (true)
+	{
+		m_cv.wait(lck, [this]{ return m_shutdown || m_readyHead != NULL; });
+		if (m_readyHead == NULL)
+		{
+			// Shutting down and nothing left to deliver
+			break;
+		}
+		DeliveryJob *job = nextJob();
+		lck.unlock();
+
+		int rv = deliver(job, arena);
+
+		lck.lock();
+		job->m_result = rv;
+		job->m_done = true;
+		job->m_cv.notify_one();
+	}
+}
+
+/**
+ * Presize the worker's buffers and create its connection cache
+ */
+DeliveryEngine::WorkerArena::WorkerArena()
+{
+	payload.signature.reserve(PAYLOAD_HEADER_SIZE);
+	payload.header.reserve(PAYLOAD_HEADER_SIZE);
+	relay.reserve(128);
+	idle.reserve(MAX_IDLE_HANDLES);
+	multi = curl_multi_init();
+	if (multi)
+	{
+		curl_multi_setopt(multi, CURLMOPT_MAXCONNECTS, (long)MAX_CACHED_CONNECTIONS);
+	}
+}
+
+/**
+ * Release the worker's curl handles, closing its cached connections
+ */
+DeliveryEngine::WorkerArena::~WorkerArena()
+{
+	for (auto curl : idle)
+	{
+		curl_easy_cleanup(curl);
+	}
+	if (multi)
+	{
+		curl_multi_cleanup(multi);
+	}
+}
+
+/**
+ * Get a curl handle for a transaction. The handle itself holds no
+ * connection, curl picks an open connection to the relay from the
+ * worker's cache when the handle is added to the worker's multi handle.
+ */
+CURL *DeliveryEngine::WorkerArena::getHandle()
+{
+	if (idle.empty())
+	{
+		return curl_easy_init();
+	}
+	CURL *curl = idle.back();
+	idle.pop_back();
+	curl_easy_reset(curl);
+	return curl;
+}
+
+/**
+ * Return a curl handle for reuse, closing it if enough are already
+ * kept. Open connections stay in the worker's cache either way.
+ */
+void DeliveryEngine::WorkerArena::putHandle(CURL *curl)
+{
+	if (idle.size() < MAX_IDLE_HANDLES)
+	{
+		idle.push_back(curl);
+	}
+	else
+	{
+		curl_easy_cleanup(curl);
+	}
+}
+
+/**
+ * Convert a curl stage time in seconds to microseconds
+ */
+static uint32_t stageUsec(CURL *curl, CURLINFO info)
+{
+	double secs = 0;
+	if (curl_easy_getinfo(curl, info, &secs) != CURLE_OK)
+	{
+		return 0;
+	}
+	return (uint32_t)(secs * 1000000);
+}
+
+/**
+ * Deliver a single message using the configured transport and
+ * note the outcome in the flight recorder
+ */
+int DeliveryEngine::deliver(DeliveryJob *job, WorkerArena& arena)
+{
+	const EmailCfg *emailCfg = job->m_emailCfg;
+	chrono::steady_clock::time_point started = chrono::steady_clock::now();
+
+	DeliveryRecord rec;
+	memset(&rec, 0, sizeof(rec));
+	gettimeofday(&rec.start, NULL);
+	rec.queueUsec = chrono::duration_cast<chrono::microseconds>(started - job->m_submitted).count();
+	rec.transport = emailCfg->transport;
+
+	compose_payload(arena.payload, emailCfg, job->m_subject, job->m_msg);
+	rec.size = arena.payload.size;
+
+	int rv;
+	switch (emailCfg->transport)
+	{
+		case TRANSPORT_SENDMAIL:
+			strncpy(rec.relay, emailCfg->sendmail_path.c_str(), RECORD_RELAY_LEN - 1);
+			rv = sendmailMsg(emailCfg, arena.payload, arena.sendmail);
+			break;
+		case TRANSPORT_MAILDIR:
+			strncpy(rec.relay, emailCfg->maildir_path.c_str(), RECORD_RELAY_LEN - 1);
+			rv = maildirMsg(emailCfg, arena.payload);
+			break;
+		default:
+			rv = deliverSmtp(emailCfg, arena, rec);
+			break;
+	}
+
+	rec.result = rv;
+	rec.totalUsec = chrono::duration_cast<chrono::microseconds>(chrono::steady_clock::now() - started).count();
+	m_recorder.record(rec);
+	return rv;
+}
+
+/**
+ * Whether the recipients of a failed transaction can be sent the message
+ * again. Only failures to reach the relay or to complete the commands
+ * before the message is sent are retried. Once the message has been sent
+ * the relay may have accepted it, so a retry could deliver it twice. A
+ * rejected login, a TLS failure or a permanent rejection will fail the
+ * same way again, and a timeout has already taken as long as allowed.
+ */
+static bool retryable(const SmtpTransaction& txn)
+{
+	if (txn.upload.started)
+	{
+		return false;
+	}
+	switch (txn.result)
+	{
+		case CURLE_FAILED_INIT:
+		case CURLE_COULDNT_RESOLVE_HOST:
+		case CURLE_COULDNT_CONNECT:
+		case CURLE_GOT_NOTHING:
+		case CURLE_RECV_ERROR:
+			return true;
+		case CURLE_SEND_ERROR:
+			// Also reported for a command the relay rejected
+			return txn.reply / 100 != 5;
+		default:
+			return false;
+	}
+}
+
+/**
+ * Deliver a message over SMTP, splitting the recipients into as many
+ * transactions as the relay requires. Recipients the relay rejects
+ * temporarily, and those in a transaction that failed before the
+ * message was sent, are retried in later rounds. Permanently rejected
+ * recipients, and those in a transaction that failed in a way that
+ * retryable() excludes, are not retried.
+ *
+ * @return	CURLE_OK if every recipient accepted the message
+ */
+int DeliveryEngine::deliverSmtp(const EmailCfg *emailCfg, WorkerArena& arena, DeliveryRecord& rec)
+{
+	const string& relay = arena.relay;
+	relayKey(emailCfg, arena.relay);
+	strncpy(rec.relay, relay.c_str(), RECORD_RELAY_LEN - 1);
+
+	vector<const string *>& pending = arena.pending;
+	pending.clear();
+	for (auto& addr : emailCfg->email_to)
+		pending.push_back(&addr);
+	for (auto& addr : emailCfg->email_cc)
+		pending.push_back(&addr);
+	for (auto& addr : emailCfg->email_bcc)
+		pending.push_back(&addr);
+
+	int rv = CURLE_OK;
+	unsigned int rejected = 0;
+	unsigned int failed = 0;
+	for (int round = 0; round < MAX_RCPT_ROUNDS && !pending.empty(); round++)
+	{
+		size_t chunk = chunkSize(relay, emailCfg, pending.size());
+		size_t count = (pending.size() + chunk - 1) / chunk;
+		if (arena.txns.size() < count)
+		{
+			arena.txns.resize(count);
+		}
+		for (size_t i = 0; i < count; i++)
+		{
+			auto first = pending.begin() + i * chunk;
+			auto last = (i + 1) * chunk < pending.size() ? first + chunk : pending.end();
+			arena.txns[i].rcpts.assign(first, last);
+			arena.txns[i].upload.payload = &arena.payload;
+		}
+		pending.clear();
+
+		runTransactions(arena, emailCfg, count);
+
+		for (size_t t = 0; t < count; t++)
+		{
+			SmtpTransaction& txn = arena.txns[t];
+			if (round == 0 && t == 0 && txn.curl)
+			{
+				// Transfer info stays valid until the handle is next used
+				curl_easy_getinfo(txn.curl, CURLINFO_RESPONSE_CODE, &rec.smtpCode);
+				rec.lookupUsec = stageUsec(txn.curl, CURLINFO_NAMELOOKUP_TIME);
+				rec.connectUsec = stageUsec(txn.curl, CURLINFO_CONNECT_TIME);
+				rec.tlsUsec = stageUsec(txn.curl, CURLINFO_APPCONNECT_TIME);
+				rec.pretransferUsec = stageUsec(txn.curl, CURLINFO_PRETRANSFER_TIME);
+			}
+			if (txn.curl)
+			{
+				arena.putHandle(txn.curl);
+			}
+			if (txn.result != CURLE_OK)
+			{
+				rv = txn.result;
+			}
+			bool retry = txn.result != CURLE_OK && retryable(txn);
+
+			size_t accepted = 0;
+			for (size_t i = 0; i < txn.rcpts.size(); i++)
+			{
+				int code = txn.codes[i];
+				if (code / 100 == 2)
+				{
+					accepted++;
+				}
+				if (i == txn.tooMany && accepted > 0)
+				{
+					// Too many recipients, the relay took this many
+					learnLimit(relay, accepted);
+				}
+
+				if (code / 100 == 2 && txn.result == CURLE_OK)
+				{
+					continue;
+				}
+				else if (code / 100 == 5)
+				{
+					Logger::getLogger()->warn("Email recipient %s rejected by %s with %d",
+							txn.rcpts[i]->c_str(), relay.c_str(), code);
+					rejected++;
+				}
+				else if (code / 100 == 4 || retry)
+				{
+					pending.push_back(txn.rcpts[i]);
+				}
+				else
+				{
+					failed++;
+				}
+			}
+		}
+	}
+
+	if (failed)
+	{
+		Logger::getLogger()->error("Email delivery to %d recipient(s) failed and will not be retried",
+				(int)failed);
+	}
+	if (!pending.empty())
+	{
+		Logger::getLogger()->error("Email delivery to %d recipient(s) abandoned after %d attempts",
+				(int)pending.size(), MAX_RCPT_ROUNDS);
+		return rv == CURLE_OK ? CURLE_SEND_ERROR : rv;
+	}
+	if (failed)
+	{
+		return rv == CURLE_OK ? CURLE_SEND_ERROR : rv;
+	}
+	if (rejected)
+	{
+		return CURLE_SEND_ERROR;
+	}
+	return CURLE_OK;
+}
+
+/**
+ * Perform a set of transactions through the worker's multi handle, so
+ * that they use the worker's connection cache. Several transactions are
+ * run in parallel, at most MAX_PARALLEL_TRANSACTIONS at a time.
+ */
+void DeliveryEngine::runTransactions(WorkerArena& arena, const EmailCfg *emailCfg, size_t count)
+{
+	const string& relay = arena.relay;
+	vector<SmtpTransaction>& txns = arena.txns;
+
+	for (size_t t = 0; t < count; t++)
+	{
+		SmtpTransaction& txn = txns[t];
+		txn.curl = arena.multi ? arena.getHandle() : NULL;
+		txn.recipients = NULL;
+		if (txn.curl)
+		{
+			setupEmailMsg(&txn, emailCfg);
+		}
+		else
+		{
+			txn.codes.assign(txn.rcpts.size(), 0);
+			txn.tooMany = txn.rcpts.size();
+			txn.upload.started = false;
+			txn.result = CURLE_FAILED_INIT;
+			txn.reply = 0;
+		}
+	}
+
+	CURLM *multi = arena.multi;
+	size_t next = 0;
+	int active = 0;
+	while (true)
+	{
+		while (active < MAX_PARALLEL_TRANSACTIONS && next < count)
+		{
+			if (txns[next].curl)
+			{
+				curl_multi_add_handle(multi, txns[next].curl);
+				active++;
+			}
+			next++;
+		}
+		if (active == 0)
+		{
+			break;
+		}
+
+		int running;
+		curl_multi_perform(multi, &running);
+		CURLMsg *msg;
+		int queued;
+		while ((msg = curl_multi_info_read(multi, &queued)) != NULL)
+		{
+			if (msg->msg == CURLMSG_DONE)
+			{
+				CURL *curl = msg->easy_handle;
+				char *txn;
+				curl_easy_getinfo(curl, CURLINFO_PRIVATE, &txn);
+				((SmtpTransaction *)txn)->result = msg->data.result;
+				curl_multi_remove_handle(multi, curl);
+				active--;
+			}
+		}
+		if (active > 0 && running > 0)
+		{
+			curl_multi_wait(multi, NULL, 0, 1000, NULL);
+		}
+	}
+
+	for (size_t t = 0; t < count; t++)
+	{
+		SmtpTransaction& txn = txns[t];
+		if (txn.result != CURLE_OK)
+		{
+			Logger::getLogger()->warn("Email transaction with %s for %d recipient(s) failed: %s",
+					relay.c_str(), (int)txn.rcpts.size(), curl_easy_strerror(txn.result));
+		}
+		finishEmailMsg(&txn);
+	}
+}
+
+/**
+ * The number of recipients to put in one transaction, the smaller of
+ * the configured maximum and any limit learnt from the relay
+ */
+size_t DeliveryEngine::chunkSize(const string& relay, const EmailCfg *emailCfg, size_t recipients)
+{
+	size_t chunk = recipients;
+	if (emailCfg->max_recipients > 0 && emailCfg->max_recipients < chunk)
+	{
+		chunk = emailCfg->max_recipients;
+	}
+	lock_guard<mutex> guard(m_limitMutex);
+	auto it = m_rcptLimit.find(relay);
+	if (it != m_rcptLimit.end() && it->second < chunk)
+	{
+		chunk = it->second;
+	}
+	return chunk > 0 ? chunk : 1;
+}
+
+/**
+ * Remember the number of recipients a relay accepted before replying
+ * 452 4.5.3, too many recipients
+ */
+void DeliveryEngine::learnLimit(const string& relay, size_t limit)
+{
+	lock_guard<mutex> guard(m_limitMutex);
+	auto it = m_rcptLimit.find(relay);
+	if (it == m_rcptLimit.end() || limit < it->second)
+	{
+		m_rcptLimit[relay] = limit;
+		Logger::getLogger()->info("Email relay %s accepts at most %d recipients per message",
+				relay.c_str(), (int)limit);
+	}
+}
+
+/**
+ * Identify a relay for the recipient limits learnt from it and for the
+ * flight recorder
+ */
+void DeliveryEngine::relayKey(const EmailCfg *emailCfg, string& key)
+{
+	char port[16];
+	snprintf(port, sizeof(port), ":%u/", emailCfg->port);
+	key.assign(emailCfg->server).append(port).append(emailCfg->username);
+}
@@ -0,0 +1,265 @@
+/*
+ * Fledge "email" notification plugin.
+ *
+ * DKIM signing of outgoing messages.
+ *
+ * Copyright (c) 2026 Dianomic Systems
+ *
+ * Released under the Apache 2.0 Licence
+ *
+ */
+#include <string>
+#include <vector>
+#include <cstdio>
+#include <cstring>
+#include <cerrno>
+#include <openssl/pem.h>
+#include <openssl/rsa.h>
+#include <email_config.h>
+#include <smtp_mail.h>
+#include <dkim_signer.h>
+#include <logger.h>
+
+using namespace std;
+
+#define DKIM_MAX_KEY_BITS	4096
+#define DKIM_MAX_SIG_LEN	(DKIM_MAX_KEY_BITS / 8)
+
+/**
+ * Load the private key and precompute the parts of the signature that
+ * are the same for every message. Use isValid() to find out if the
+ * signer could be created.
+ *
+ * @param emailCfg	The plugin configuration
+ */
+DkimSigner::DkimSigner(const EmailCfg *emailCfg) : m_pkey(NULL), m_pkeyCtx(NULL),
+		m_bodyCtx(NULL), m_headerCtx(NULL), m_breaks(0), m_cr(false)
+{
+	m_bodyHash[0] = 0;
+
+	FILE *fp = fopen(emailCfg->dkim_key_file.c_str(), "r");
+	if (!fp)
+	{
+		Logger::getLogger()->error("DKIM: unable to open private key %s, %s",
+				emailCfg->dkim_key_file.c_str(), strerror(errno));
+		return;
+	}
+	m_pkey = PEM_read_PrivateKey(fp, NULL, NULL, NULL);
+	fclose(fp);
+	if (!m_pkey || EVP_PKEY_base_id(m_pkey) != EVP_PKEY_RSA
+			|| EVP_PKEY_bits(m_pkey) > DKIM_MAX_KEY_BITS)
+	{
+		Logger::getLogger()->error("DKIM: %s is not a PEM RSA private key of at most %d bits",
+				emailCfg->dkim_key_file.c_str(), DKIM_MAX_KEY_BITS);
+		return;
+	}
+
+	m_bodyCtx = EVP_MD_CTX_new();
+	m_headerCtx = EVP_MD_CTX_new();
+	EVP_PKEY_CTX *ctx = EVP_PKEY_CTX_new(m_pkey, NULL);
+	if (!m_bodyCtx || !m_headerCtx || !ctx
+			|| EVP_PKEY_sign_init(ctx) <= 0
+			|| EVP_PKEY_CTX_set_rsa_padding(ctx, RSA_PKCS1_PADDING) <= 0
+			|| EVP_PKEY_CTX_set_signature_md(ctx, EVP_sha256()) <= 0)
+	{
+		Logger::getLogger()->error("DKIM: unable to initialise signing context");
+		EVP_PKEY_CTX_free(ctx);
+		return;
+	}
+
+	// The headers that only change on reconfiguration
+	string raw;
+	string tags = "from";
+	compose_from_header(raw, emailCfg, "\r\n");
+	canonHeader(m_staticHeaders, "from", raw.c_str() + 6, raw.size() - 8);
+	if (emailCfg->email_to.size())
+	{
+		raw.clear();
+		compose_address_header(raw, "To: ", emailCfg->email_to, emailCfg->email_to_name, "\r\n");
+		canonHeader(m_staticHeaders, "to", raw.c_str() + 4, raw.size() - 6);
+		tags.append(":to");
+	}
+	if (emailCfg->email_cc.size())
+	{
+		raw.clear();
+		compose_address_header(raw, "CC: ", emailCfg->email_cc, emailCfg->email_cc_name, "\r\n");
+		canonHeader(m_staticHeaders, "cc", raw.c_str() + 4, raw.size() - 6);
+		tags.append(":cc");
+	}
+	tags.append(":subject:date");
+
+	m_tags = "v=1; a=rsa-sha256; c=relaxed/simple; d=" + emailCfg->dkim_domain
+			+ "; s=" + emailCfg->dkim_selector + "; h=" + tags + "; bh=";
+	m_canon.reserve(m_staticHeaders.size() + m_tags.size() + 1024);
+	m_pkeyCtx = ctx;
+}
+
+/**
+ * Release the key and digest contexts
+ */
+DkimSigner::~DkimSigner()
+{
+	EVP_PKEY_CTX_free(m_pkeyCtx);
+	EVP_MD_CTX_free(m_bodyCtx);
+	EVP_MD_CTX_free(m_headerCtx);
+	EVP_PKEY_free(m_pkey);
+}
+
+/**
+ * Append a header in relaxed canonical form: lower case name, no
+ * folding, runs of white space reduced to a single space and no white
+ * space at either end of the value.
+ */
+void DkimSigner::canonHeader(string& out, const char *name, const char *value, size_t len)
+{
+	out.append(name).append(":");
+	bool space = false;
+	bool started = false;
+	for (size_t i = 0; i < len; i++)
+	{
+		char c = value[i];
+		if (c == '\r' || c == '\n')
+		{
+			continue;
+		}
+		if (c == ' ' || c == '\t')
+		{
+			space = true;
+			continue;
+		}
+		if (space && started)
+		{
+			out.append(1, ' ');
+		}
+		space = false;
+		started = true;
+		out.append(1, c);
+	}
+	out.append("\r\n");
+}
+
+/**
+ * Start hashing a new message body
+ */
+void DkimSigner::bodyBegin()
+{
+	EVP_DigestInit_ex(m_bodyCtx, EVP_sha256(), NULL);
+	m_breaks = 0;
+	m_cr = false;
+}
+
+/**
+ * Hash body content, first writing any line breaks held back
+ */
+void DkimSigner::bodyEmit(const char *data, size_t len)
+{
+	if (len == 0)
+	{
+		return;
+	}
+	for (; m_breaks > 0; m_breaks--)
+	{
+		EVP_DigestUpdate(m_bodyCtx, "\r\n", 2);
+	}
+	EVP_DigestUpdate(m_bodyCtx, data, len);
+}
+
+/**
+ * Hash the next part of the body in simple canonical form. Line breaks
+ * are held back until more content arrives, so that empty lines at the
+ * end of the body are ignored, and bare LF line endings are hashed as
+ * CRLF.
+ */
+void DkimSigner::bodyUpdate(const char *data, size_t len)
+{
+	size_t start = 0;
+	for (size_t i = 0; i < len; i++)
+	{
+		char c = data[i];
+		if (m_cr)
+		{
+			m_cr = false;
+			if (c == '\n')
+			{
+				m_breaks++;
+				start = i + 1;
+				continue;
+			}
+			// A CR on its own is content
+			bodyEmit("\r", 1);
+			start = i;
+		}
+		if (c == '\r' || c == '\n')
+		{
+			bodyEmit(data + start, i - start);
+			start = i + 1;
+			if (c == '\r')
+				m_cr = true;
+			else
+				m_breaks++;
+		}
+	}
+	bodyEmit(data + start, len - start);
+}
+
+/**
+ * Finish the body hash, the body always ends with a single CRLF
+ */
+void DkimSigner::bodyEnd()
+{
+	unsigned char md[EVP_MAX_MD_SIZE];
+	unsigned int mdLen;
+
+	if (m_cr)
+	{
+		bodyEmit("\r", 1);
+		m_cr = false;
+	}
+	m_breaks = 0;
+	EVP_DigestUpdate(m_bodyCtx, "\r\n", 2);
+	EVP_DigestFinal_ex(m_bodyCtx, md, &mdLen);
+	EVP_EncodeBlock((unsigned char *)m_bodyHash, md, mdLen);
+}
+
+/**
+ * Create the DKIM-Signature header for a message whose body has been
+ * hashed with bodyBegin(), bodyUpdate() and bodyEnd().
+ *
+ * @param date		The value of the Date header
+ * @param subject	The value of the Subject header
+ * @param eol		The line ending used by the message
+ * @param out		Buffer the complete header line is written to
+ * @return		True if the message was signed
+ */
+bool DkimSigner::sign(const char *date, const char *subject, const char *eol, string& out)
+{
+	if (!m_pkeyCtx)
+	{
+		return false;
+	}
+
+	// The headers named in h=, then the signature header with an empty b=
+	m_canon.assign(m_staticHeaders);
+	canonHeader(m_canon, "subject", subject, strlen(subject));
+	canonHeader(m_canon, "date", date, strlen(date));
+	m_canon.append("dkim-signature:").append(m_tags).append(m_bodyHash).append("; b=");
+
+	unsigned char md[EVP_MAX_MD_SIZE];
+	unsigned int mdLen;
+	EVP_DigestInit_ex(m_headerCtx, EVP_sha256(), NULL);
+	EVP_DigestUpdate(m_headerCtx, m_canon.data(), m_canon.size());
+	EVP_DigestFinal_ex(m_headerCtx, md, &mdLen);
+
+	unsigned char sig[DKIM_MAX_SIG_LEN];
+	size_t sigLen = sizeof(sig);
+	if (EVP_PKEY_sign(m_pkeyCtx, sig, &sigLen, md, mdLen) <= 0)
+	{
+		Logger::getLogger()->error("DKIM: signing failed");
+		return false;
+	}
+	char b64[((DKIM_MAX_SIG_LEN + 2) / 3) * 4 + 1];
+	EVP_EncodeBlock((unsigned char *)b64, sig, sigLen);
+
+	out.assign("DKIM-Signature: ").append(m_tags).append(m_bodyHash).append("; b=").append(b64).append(eol);
+	return true;
+}
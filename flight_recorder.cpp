@@ -0,0 +1,91 @@
+/*
+ * Fledge "email" notification plugin.
+ *
+ * In memory flight recorder of recent deliveries.
+ *
+ * Copyright (c) 2026 Dianomic Systems
+ *
+ * Released under the Apache 2.0 Licence
+ *
+ */
+#include <ctime>
+#include <cstring>
+#include <flight_recorder.h>
+#include <logger.h>
+
+using namespace std;
+
+static const char *transportNames[] = { "SMTP", "sendmail", "maildir" };
+
+/**
+ * Construct an empty flight recorder
+ */
+FlightRecorder::FlightRecorder() : m_head(0)
+{
+	for (int i = 0; i < FLIGHT_RECORDER_SIZE; i++)
+	{
+		m_slots[i].seq.store(0, memory_order_relaxed);
+	}
+}
+
+/**
+ * Record a delivery, overwriting the oldest entry. If the slot is
+ * still being written by a delivery that has been lapped the record
+ * is dropped rather than waiting.
+ */
+void FlightRecorder::record(const DeliveryRecord& rec)
+{
+	uint64_t idx = m_head.fetch_add(1, memory_order_relaxed);
+	Slot& slot = m_slots[idx % FLIGHT_RECORDER_SIZE];
+
+	uint32_t seq = slot.seq.load(memory_order_relaxed);
+	if ((seq & 1) || !slot.seq.compare_exchange_strong(seq, seq + 1, memory_order_acquire))
+	{
+		return;
+	}
+	atomic_thread_fence(memory_order_release);
+	slot.rec = rec;
+	slot.seq.store(seq + 2, memory_order_release);
+}
+
+/**
+ * Write the recorded deliveries to the log, oldest first
+ *
+ * @param reason	Why the dump was requested
+ */
+void FlightRecorder::dump(const char *reason)
+{
+	uint64_t head = m_head.load(memory_order_acquire);
+	uint64_t first = head > FLIGHT_RECORDER_SIZE ? head - FLIGHT_RECORDER_SIZE : 0;
+	Logger *logger = Logger::getLogger();
+
+	logger->warn("Email delivery flight recorder dump (%s): last %d deliveries",
+			reason, (int)(head - first));
+	for (uint64_t i = first; i < head; i++)
+	{
+		Slot& slot = m_slots[i % FLIGHT_RECORDER_SIZE];
+		uint32_t seq = slot.seq.load(memory_order_acquire);
+		if (seq == 0 || (seq & 1))
+		{
+			continue;
+		}
+		DeliveryRecord rec = slot.rec;
+		atomic_thread_fence(memory_order_acquire);
+		if (slot.seq.load(memory_order_relaxed) != seq)
+		{
+			// Overwritten while we were reading it
+			continue;
+		}
+
+		struct tm tm;
+		char when[32];
+		localtime_r(&rec.start.tv_sec, &tm);
+		strftime(when, sizeof(when), "%Y-%m-%d %H:%M:%S", &tm);
+		const char *transport = (rec.transport >= 0 && rec.transport < 3) ?
+				transportNames[rec.transport] : "unknown";
+		logger->warn("  %s.%06ld %s relay=%s size=%u result=%d smtp=%ld queue=%uus lookup=%uus connect=%uus tls=%uus pretransfer=%uus total=%uus",
+				when, (long)rec.start.tv_usec, transport, rec.relay, rec.size,
+				rec.result, rec.smtpCode, rec.queueUsec, rec.lookupUsec,
+				rec.connectUsec, rec.tlsUsec, rec.pretransferUsec, rec.totalUsec);
+	}
+}
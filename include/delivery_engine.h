@@ -0,0 +1,172 @@
+#ifndef _DELIVERY_ENGINE_H
+#define _DELIVERY_ENGINE_H
+/*
+ * Fledge email notification plugin
+ *
+ * Copyright (c) 2026 Dianomic Systems
+ *
+ * Released under the Apache 2.0 Licence
+ *
+ */
+#include <string>
+#include <vector>
+#include <map>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <chrono>
+#include <curl/curl.h>
+#include <email_config.h>
+#include <flight_recorder.h>
+#include <smtp_mail.h>
+#include <local_mail.h>
+
+#define DELIVERY_WORKERS		4	// Worker threads shared by all plugin instances
+#define MAX_PARALLEL_TRANSACTIONS	4	// Concurrent SMTP transactions per message
+#define MAX_IDLE_HANDLES		MAX_PARALLEL_TRANSACTIONS	// Curl handles each worker keeps for reuse
+#define MAX_CACHED_CONNECTIONS		(2 * MAX_PARALLEL_TRANSACTIONS)	// Open connections each worker keeps
+#define MAX_RCPT_ROUNDS			3	// Most attempts made for each recipient
+
+class DeliveryEngine;
+
+/**
+ * The queue of messages waiting to be delivered for one plugin
+ * instance. Each plugin handle owns one and the waiting messages are
+ * linked through it, so submitting a message makes no allocations.
+ */
+class DeliveryQueue {
+	public:
+		DeliveryQueue() : m_head(NULL), m_tail(NULL),
+				m_nextReady(NULL), m_ready(false) {};
+
+	private:
+		friend class DeliveryEngine;
+		class DeliveryJob	*m_head;
+		class DeliveryJob	*m_tail;
+		DeliveryQueue		*m_nextReady;	// Next queue in the round robin
+		bool			m_ready;	// Queue is in the round robin
+};
+
+/**
+ * A message waiting for, or being processed by, a delivery worker.
+ * Jobs live on the stack of the thread that submitted them.
+ */
+class DeliveryJob {
+	public:
+		DeliveryJob(const EmailCfg *emailCfg, const char *subject, const char *msg) :
+			m_emailCfg(emailCfg), m_subject(subject), m_msg(msg),
+			m_result(CURLE_OK), m_done(false), m_next(NULL),
+			m_submitted(std::chrono::steady_clock::now()) {};
+		const EmailCfg		*m_emailCfg;
+		const char		*m_subject;
+		const char		*m_msg;
+		int			m_result;
+		bool			m_done;
+		DeliveryJob		*m_next;
+		std::chrono::steady_clock::time_point
+					m_submitted;
+		std::condition_variable	m_cv;
+};
+
+/**
+ * A process wide delivery engine shared by every instance of the
+ * email notification plugin.
+ *
+ * All plugin handles submit their messages to the one engine, which owns
+ * a fixed pool of worker threads. Each worker keeps its own cache of
+ * open SMTP connections in its curl multi handle, libcurl does not
+ * support sharing a connection cache between threads that use it at the
+ * same time. A connection left open by one delivery is reused by the
+ * next delivery the same worker makes to that relay, and at most
+ * MAX_CACHED_CONNECTIONS are kept open by each worker. Pending messages
+ * are queued per plugin instance and the instances are served round
+ * robin, so a single busy notification cannot starve the others. The engine is created by
+ * the first plugin_init and destroyed by the last plugin_shutdown.
+ *
+ * Messages with more recipients than the relay accepts in one
+ * transaction are split into several transactions that are sent in
+ * parallel over separate connections. Recipients the relay rejects
+ * temporarily, or that could not be sent to because the relay could not
+ * be reached, are retried in later transactions without resending to
+ * the others. Nothing is retried once the message itself has been sent.
+ *
+ * Every delivery is noted in a flight recorder that can be dumped to
+ * the log when deliveries start failing.
+ *
+ * Each worker composes and sends messages using buffers it keeps for its
+ * lifetime, so once they have grown to fit the messages being sent a
+ * delivery makes no heap allocations outside of libcurl. DKIM signing is
+ * the exception, OpenSSL allocates for each message it signs, about 26
+ * times for an RSA key.
+ */
+class DeliveryEngine {
+	public:
+		static DeliveryEngine	*acquire();
+		static void		release();
+
+		int			submit(DeliveryQueue *queue,
+						const EmailCfg *emailCfg,
+						const char *subject,
+						const char *msg);
+		void			dumpRecorder(const char *reason)
+					{
+						m_recorder.dump(reason);
+					};
+
+	private:
+		/**
+		 * The buffers a worker reuses from one delivery to the next
+		 */
+		class WorkerArena {
+			public:
+				WorkerArena();
+				~WorkerArena();
+				MessagePayload		payload;
+				std::string		relay;
+				std::vector<const std::string *>
+							pending;
+				std::vector<SmtpTransaction>
+							txns;	// Only ever grows
+				SendmailContext		sendmail;
+				CURLM			*multi;	// Holds the connection cache
+				std::vector<CURL *>	idle;	// Handles not in use
+				CURL			*getHandle();
+				void			putHandle(CURL *curl);
+		};
+
+		DeliveryEngine();
+		~DeliveryEngine();
+		void			worker();
+		DeliveryJob		*nextJob();
+		int			deliver(DeliveryJob *job, WorkerArena& arena);
+		int			deliverSmtp(const EmailCfg *emailCfg,
+						WorkerArena& arena,
+						DeliveryRecord& rec);
+		void			runTransactions(WorkerArena& arena,
+						const EmailCfg *emailCfg,
+						size_t count);
+		size_t			chunkSize(const std::string& relay,
+						const EmailCfg *emailCfg,
+						size_t recipients);
+		void			learnLimit(const std::string& relay,
+						size_t limit);
+		static void		relayKey(const EmailCfg *emailCfg, std::string& key);
+
+		static std::mutex	m_instanceMutex;
+		static DeliveryEngine	*m_instance;
+		static unsigned int	m_refCount;
+
+		std::mutex		m_mutex;
+		std::condition_variable	m_cv;
+		bool			m_shutdown;
+		std::vector<std::thread>
+					m_workers;
+		DeliveryQueue		*m_readyHead;
+		DeliveryQueue		*m_readyTail;
+		std::mutex		m_limitMutex;
+		std::map<std::string, size_t>
+					m_rcptLimit;	// Learnt from 4.5.3 replies
+		FlightRecorder		m_recorder;
+};
+
+#endif
@@ -0,0 +1,61 @@
+#ifndef _DKIM_SIGNER_H
+#define _DKIM_SIGNER_H
+/*
+ * Fledge email notification plugin
+ *
+ * Copyright (c) 2026 Dianomic Systems
+ *
+ * Released under the Apache 2.0 Licence
+ *
+ */
+#include <string>
+#include <openssl/evp.h>
+
+struct EmailCfg;
+
+#define DKIM_HASH_B64_LEN	44	// Base64 length of a SHA-256 digest
+
+/**
+ * DKIM signer for the messages of one plugin instance, using
+ * rsa-sha256 with relaxed header and simple body canonicalization.
+ *
+ * The private key is loaded once, when the signer is created, and the
+ * canonical form of the headers that do not change between messages,
+ * From, To and CC, is computed at the same time. The body hash is
+ * computed as the body is rendered, so signing a message only costs
+ * the canonicalization of the Date and Subject headers and one RSA
+ * signature, however large the body.
+ *
+ * A signer is used by one delivery at a time.
+ */
+class DkimSigner {
+	public:
+		DkimSigner(const EmailCfg *emailCfg);
+		~DkimSigner();
+		bool		isValid() const { return m_pkeyCtx != NULL; };
+
+		void		bodyBegin();
+		void		bodyUpdate(const char *data, size_t len);
+		void		bodyEnd();
+
+		bool		sign(const char *date, const char *subject,
+					const char *eol, std::string& out);
+
+	private:
+		void		bodyEmit(const char *data, size_t len);
+		static void	canonHeader(std::string& out, const char *name,
+					const char *value, size_t len);
+
+		EVP_PKEY	*m_pkey;
+		EVP_PKEY_CTX	*m_pkeyCtx;	// Initialised once for signing
+		EVP_MD_CTX	*m_bodyCtx;
+		EVP_MD_CTX	*m_headerCtx;
+		std::string	m_staticHeaders;	// Canonical From, To and CC
+		std::string	m_tags;			// Signature tags up to bh=
+		std::string	m_canon;		// Per message canonical headers
+		unsigned int	m_breaks;	// Line breaks not yet hashed
+		bool		m_cr;		// Last body character was CR
+		char		m_bodyHash[DKIM_HASH_B64_LEN + 1];
+};
+
+#endif
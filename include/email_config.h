@@ -10,6 +10,17 @@
  * Author: Amandeep Singh Arora
  */
 
+class DkimSigner;
+
+/**
+ * How a composed message is handed on for delivery
+ */
+enum EmailTransport {
+	TRANSPORT_SMTP,		// SMTP over TCP to the configured server
+	TRANSPORT_SENDMAIL,	// Pipe to a local sendmail compatible binary
+	TRANSPORT_MAILDIR	// Drop into a local maildir/queue directory
+};
+
 struct EmailCfg {
 	std::string email_from;
 	std::string email_from_name;
@@ -26,6 +37,18 @@ struct EmailCfg {
 	bool use_ssl_tls;
 	std::string username; // required only in case of SSL/TLS
 	std::string password; // required only in case of SSL/TLS
+	EmailTransport transport;
+	std::string sendmail_path; // required only for sendmail transport
+	std::string maildir_path; // required only for maildir transport
+	unsigned int max_recipients; // recipients per SMTP transaction, 0 for no limit
+	unsigned int connect_timeout; // seconds allowed to connect to the SMTP server, 0 for no limit
+	unsigned int transfer_timeout; // seconds allowed for a whole SMTP transaction or sendmail hand-off, 0 for no limit
+	unsigned int recorder_threshold; // consecutive failures that dump the flight recorder
+	bool dkim_enable;
+	std::string dkim_domain; // required only for DKIM signing
+	std::string dkim_selector; // required only for DKIM signing
+	std::string dkim_key_file; // required only for DKIM signing
+	DkimSigner *dkim; // signer loaded from the above, NULL if not signing
 };
 
 #endif
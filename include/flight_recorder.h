@@ -0,0 +1,61 @@
+#ifndef _FLIGHT_RECORDER_H
+#define _FLIGHT_RECORDER_H
+/*
+ * Fledge email notification plugin
+ *
+ * Copyright (c) 2026 Dianomic Systems
+ *
+ * Released under the Apache 2.0 Licence
+ *
+ */
+#include <atomic>
+#include <cstdint>
+#include <sys/time.h>
+
+#define FLIGHT_RECORDER_SIZE	128	// Number of deliveries remembered
+#define RECORD_RELAY_LEN	64
+
+/**
+ * The details kept for a single delivery attempt. All stage timings
+ * are in microseconds and, as with curl, are measured from the start
+ * of the transfer, so they accumulate.
+ */
+struct DeliveryRecord {
+	struct timeval	start;		// Wall clock time the delivery started
+	uint32_t	queueUsec;	// Time spent waiting for a worker
+	uint32_t	lookupUsec;	// Name resolution complete
+	uint32_t	connectUsec;	// TCP connection established
+	uint32_t	tlsUsec;	// TLS handshake complete
+	uint32_t	pretransferUsec;// SMTP envelope accepted
+	uint32_t	totalUsec;	// Delivery complete
+	long		smtpCode;	// Last SMTP response code, 0 if none
+	int		result;		// Delivery result code
+	uint32_t	size;		// Size of the whole message in bytes
+	int		transport;	// EmailTransport used
+	char		relay[RECORD_RELAY_LEN];
+};
+
+/**
+ * A lock free ring buffer of the most recent deliveries.
+ *
+ * Recording a delivery is a single atomic increment and a copy into a
+ * preallocated slot. Each slot carries a sequence number, odd while it
+ * is being written, so that a dump taken while deliveries are running
+ * skips slots that are being overwritten rather than blocking them.
+ */
+class FlightRecorder {
+	public:
+		FlightRecorder();
+		void		record(const DeliveryRecord& rec);
+		void		dump(const char *reason);
+
+	private:
+		struct Slot {
+			std::atomic<uint32_t>	seq;
+			DeliveryRecord		rec;
+		};
+		std::atomic<uint64_t>	m_head;
+		Slot			m_slots[FLIGHT_RECORDER_SIZE];
+};
+
+#endif
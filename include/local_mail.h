@@ -0,0 +1,44 @@
+#ifndef _LOCAL_MAIL_H
+#define _LOCAL_MAIL_H
+/*
+ * Fledge email notification plugin
+ *
+ * Copyright (c) 2026 Dianomic Systems
+ *
+ * Released under the Apache 2.0 Licence
+ *
+ */
+#include <string>
+#include <vector>
+#include <spawn.h>
+#include <email_config.h>
+#include <smtp_mail.h>
+
+/**
+ * What a delivery worker keeps to run sendmail without allocating.
+ *
+ * libc allocates when spawn file actions are added, so the actions are
+ * built once. They make a descriptor reserved for the worker the
+ * standard input of sendmail, and the read end of each message's pipe
+ * is moved onto that descriptor while sendmail is started. In between
+ * messages the reserved descriptor refers to /dev/null.
+ */
+class SendmailContext {
+	public:
+		SendmailContext();
+		~SendmailContext();
+		std::vector<const char *>	argv;
+		int				nullFd;
+		int				stdinFd;	// Reserved descriptor
+		posix_spawn_file_actions_t	actions;
+		posix_spawnattr_t		attr;
+		bool				ready;
+};
+
+extern "C" {
+int sendmailMsg(const EmailCfg *emailCfg, const MessagePayload& payload, SendmailContext& ctx);
+int maildirMsg(const EmailCfg *emailCfg, const MessagePayload& payload);
+bool prepareMaildir(const EmailCfg *emailCfg);
+};
+
+#endif
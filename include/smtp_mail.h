@@ -0,0 +1,87 @@
+#ifndef _SMTP_MAIL_H
+#define _SMTP_MAIL_H
+/*
+ * Fledge email notification plugin
+ *
+ * Copyright (c) 2018 Dianomic Systems
+ *
+ * Released under the Apache 2.0 Licence
+ *
+ */
+#include <string>
+#include <vector>
+#include <sys/uio.h>
+#include <curl/curl.h>
+#include <email_config.h>
+
+#define PAYLOAD_HEADER_SIZE	1024	// Initial capacity of the header buffer
+
+enum {
+	PAYLOAD_SIGNATURE,	// DKIM-Signature header, empty if not signing
+	PAYLOAD_HEADER,		// Rendered header lines and blank separator
+	PAYLOAD_BODY,		// The message body, not copied
+	PAYLOAD_TRAILER,	// Final line ending
+	PAYLOAD_SEGMENTS
+};
+
+/**
+ * A composed message. The headers are rendered into a buffer that is
+ * reused from one message to the next, the body is referenced in place.
+ * The same segments are sent over SMTP and written to local transports.
+ */
+struct MessagePayload {
+	std::string	signature;
+	std::string	header;
+	struct iovec	iov[PAYLOAD_SEGMENTS];
+	size_t		size;
+};
+
+struct upload_status {
+	int segment;		// Payload segment being sent
+	size_t offset;		// Bytes of that segment already sent
+	bool started;		// DATA was accepted and sending began
+	const MessagePayload* payload;
+};
+
+/**
+ * A single SMTP transaction: one MAIL FROM, a set of RCPT TO
+ * commands and the DATA. The SMTP reply to each RCPT TO is captured
+ * so that accepted and rejected recipients can be told apart.
+ *
+ * Transactions are kept and reused by the delivery workers, the
+ * vectors and scratch buffer keep their capacity between messages.
+ */
+struct SmtpTransaction {
+	CURL				*curl;
+	struct curl_slist		*recipients;
+	struct upload_status		upload;
+	std::vector<const std::string *> rcpts;	// Addresses in RCPT order
+	std::vector<int>		codes;	// Reply to each RCPT, 0 if not sent
+	size_t				sent;	// RCPT commands sent
+	size_t				answered; // RCPT replies received
+	size_t				tooMany; // First RCPT refused with 4.5.3, or rcpts.size()
+	CURLcode			result;
+	long				reply;	// Last reply from the server
+	std::string			scratch; // Option strings, copied by curl
+};
+
+/**
+ * The line ending used in a composed message. CRLF for SMTP, the local
+ * transports use local LF line endings.
+ */
+inline const char *payload_eol(const EmailCfg *emailCfg)
+{
+	return emailCfg->transport == TRANSPORT_SMTP ? "\r\n" : "\n";
+}
+
+extern "C" {
+void compose_address_header(std::string& header, const char *field,
+		const std::vector<std::string>& addrs, const std::vector<std::string>& names,
+		const char *eol);
+void compose_from_header(std::string& header, const EmailCfg *emailCfg, const char *eol);
+void compose_payload(MessagePayload& payload, const EmailCfg *emailCfg, const char *subject, const char *msg);
+void setupEmailMsg(SmtpTransaction *txn, const EmailCfg *emailCfg);
+void finishEmailMsg(SmtpTransaction *txn);
+};
+
+#endif
@@ -0,0 +1,398 @@
+/*
+ * Fledge "email" notification plugin.
+ *
+ * Local submission transports: hand the composed message to a local
+ * MTA either through a sendmail compatible binary or by dropping it
+ * into a maildir/queue directory.
+ *
+ * Copyright (c) 2026 Dianomic Systems
+ *
+ * Released under the Apache 2.0 Licence
+ *
+ */
+#include <string>
+#include <vector>
+#include <atomic>
+#include <cerrno>
+#include <cstring>
+#include <cstdio>
+#include <csignal>
+#include <climits>
+#include <ctime>
+#include <fcntl.h>
+#include <poll.h>
+#include <spawn.h>
+#include <unistd.h>
+#include <sys/uio.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+#include <curl/curl.h>
+#include <email_config.h>
+#include <smtp_mail.h>
+#include <local_mail.h>
+#include <logger.h>
+
+using namespace std;
+
+extern char **environ;
+
+/**
+ * Reserve the descriptor that becomes the standard input of sendmail
+ * and build the spawn file actions and attributes once
+ */
+SendmailContext::SendmailContext() : nullFd(-1), stdinFd(-1), ready(false)
+{
+	posix_spawn_file_actions_init(&actions);
+	posix_spawnattr_init(&attr);
+
+	nullFd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+	if (nullFd == -1)
+	{
+		return;
+	}
+	stdinFd = fcntl(nullFd, F_DUPFD_CLOEXEC, 0);
+	if (stdinFd == -1 || posix_spawn_file_actions_adddup2(&actions, stdinFd, STDIN_FILENO) != 0)
+	{
+		return;
+	}
+
+	// SIGPIPE is blocked while a message is written, the child gets an
+	// unblocked signal mask. It runs in its own process group so that
+	// it can be killed along with any processes it starts.
+	sigset_t emptySet;
+	sigemptyset(&emptySet);
+	posix_spawnattr_setsigmask(&attr, &emptySet);
+	posix_spawnattr_setpgroup(&attr, 0);
+	posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGMASK | POSIX_SPAWN_SETPGROUP);
+	ready = true;
+}
+
+/**
+ * Release the reserved descriptors and spawn state
+ */
+SendmailContext::~SendmailContext()
+{
+	posix_spawn_file_actions_destroy(&actions);
+	posix_spawnattr_destroy(&attr);
+	if (stdinFd != -1)
+		close(stdinFd);
+	if (nullFd != -1)
+		close(nullFd);
+}
+
+extern "C" {
+
+/**
+ * The time left before a deadline in milliseconds, 0 once it has passed
+ */
+static int remaining_ms(const struct timespec& deadline)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	long ms = (deadline.tv_sec - now.tv_sec) * 1000 + (deadline.tv_nsec - now.tv_nsec) / 1000000;
+	return ms > 0 ? (ms < INT_MAX ? (int)ms : INT_MAX) : 0;
+}
+
+/**
+ * Write the whole iovec array, coping with short writes. The array
+ * is updated as it is written.
+ *
+ * With a deadline the descriptor must be non-blocking, the write waits
+ * for the descriptor to become writable until the deadline passes.
+ *
+ * @param deadline	The CLOCK_MONOTONIC deadline or NULL for none
+ * @return		0 on success, ETIMEDOUT if the deadline passed or the
+ *			errno of the failed write
+ */
+static int writev_all(int fd, struct iovec *iov, int iovcnt, const struct timespec *deadline)
+{
+	while (iovcnt > 0)
+	{
+		ssize_t n = writev(fd, iov, iovcnt);
+		if (n < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			if (errno != EAGAIN || !deadline)
+				return errno;
+			struct pollfd pfd = { fd, POLLOUT, 0 };
+			int timeout = remaining_ms(*deadline);
+			if (timeout == 0 || poll(&pfd, 1, timeout) == 0)
+				return ETIMEDOUT;
+			continue;
+		}
+		while (iovcnt > 0 && (size_t)n >= iov->iov_len)
+		{
+			n -= iov->iov_len;
+			iov++;
+			iovcnt--;
+		}
+		if (iovcnt > 0)
+		{
+			iov->iov_base = (char *)iov->iov_base + n;
+			iov->iov_len -= n;
+		}
+	}
+	return 0;
+}
+
+/**
+ * Wait for a child to exit, polling its status until the deadline
+ * passes
+ *
+ * @param deadline	The CLOCK_MONOTONIC deadline or NULL for none
+ * @return		The pid, 0 if the deadline passed or -1 on error
+ */
+static pid_t reap_child(pid_t pid, int *status, const struct timespec *deadline)
+{
+	long pauseNsec = 1000000;
+	while (true)
+	{
+		pid_t waited = waitpid(pid, status, deadline ? WNOHANG : 0);
+		if (waited == -1 && errno == EINTR)
+			continue;
+		if (waited != 0 || !deadline || remaining_ms(*deadline) == 0)
+			return waited;
+		struct timespec pause = { 0, pauseNsec };
+		nanosleep(&pause, NULL);
+		if (pauseNsec < 50000000)
+			pauseNsec *= 2;
+	}
+}
+
+/**
+ * Pipe the message to a sendmail compatible binary. The envelope
+ * sender and recipients, including BCC, are passed on the command
+ * line so, as for SMTP, BCC recipients are not added to the headers.
+ *
+ * Writing the message and waiting for sendmail to exit are limited by
+ * the transfer timeout, sendmail is killed if it takes longer.
+ *
+ * @param emailCfg	The plugin configuration
+ * @param payload	The composed message
+ * @param ctx		The worker's reusable sendmail state
+ */
+int sendmailMsg(const EmailCfg *emailCfg, const MessagePayload& payload, SendmailContext& ctx)
+{
+	if (!ctx.ready)
+	{
+		Logger::getLogger()->error("Email sendmail transport: unable to reserve a descriptor for sendmail");
+		return CURLE_FAILED_INIT;
+	}
+
+	struct iovec iov[PAYLOAD_SEGMENTS];
+	memcpy(iov, payload.iov, sizeof(iov));
+
+	vector<const char *>& argv = ctx.argv;
+	argv.clear();
+	argv.push_back(emailCfg->sendmail_path.c_str());
+	argv.push_back("-i");
+	argv.push_back("-f");
+	argv.push_back(emailCfg->email_from.c_str());
+	argv.push_back("--");
+	for (auto& addr : emailCfg->email_to)
+		argv.push_back(addr.c_str());
+	for (auto& addr : emailCfg->email_cc)
+		argv.push_back(addr.c_str());
+	for (auto& addr : emailCfg->email_bcc)
+		argv.push_back(addr.c_str());
+	argv.push_back(NULL);
+
+	int fds[2];
+	if (pipe2(fds, O_CLOEXEC) == -1)
+	{
+		Logger::getLogger()->error("Email sendmail transport: pipe failed, %s", strerror(errno));
+		return CURLE_FAILED_INIT;
+	}
+	// Move the read end onto the descriptor the file actions make stdin
+	if (dup3(fds[0], ctx.stdinFd, O_CLOEXEC) == -1)
+	{
+		Logger::getLogger()->error("Email sendmail transport: dup failed, %s", strerror(errno));
+		close(fds[0]);
+		close(fds[1]);
+		return CURLE_FAILED_INIT;
+	}
+	close(fds[0]);
+	// Only the write end is waited on with a deadline, sendmail reads
+	// its stdin blocking
+	if (emailCfg->transfer_timeout)
+		fcntl(fds[1], F_SETFL, O_NONBLOCK);
+
+	// Block SIGPIPE in this thread so an early exit of sendmail is
+	// reported as EPIPE, the child gets an unblocked signal mask
+	sigset_t pipeSet, oldSet;
+	sigemptyset(&pipeSet);
+	sigaddset(&pipeSet, SIGPIPE);
+	pthread_sigmask(SIG_BLOCK, &pipeSet, &oldSet);
+
+	pid_t pid;
+	int rv = posix_spawn(&pid, emailCfg->sendmail_path.c_str(), &ctx.actions, &ctx.attr,
+				(char * const *)argv.data(), environ);
+	// Only sendmail may keep the read end open, or its early exit
+	// would not be seen as EPIPE
+	dup3(ctx.nullFd, ctx.stdinFd, O_CLOEXEC);
+
+	int res = CURLE_OK;
+	if (rv != 0)
+	{
+		Logger::getLogger()->error("Email sendmail transport: unable to run %s, %s",
+				emailCfg->sendmail_path.c_str(), strerror(rv));
+		close(fds[1]);
+		res = CURLE_FAILED_INIT;
+	}
+	else
+	{
+		struct timespec deadline;
+		clock_gettime(CLOCK_MONOTONIC, &deadline);
+		deadline.tv_sec += emailCfg->transfer_timeout;
+		const struct timespec *limit = emailCfg->transfer_timeout ? &deadline : NULL;
+
+		int err = writev_all(fds[1], iov, PAYLOAD_SEGMENTS, limit);
+		close(fds[1]);
+		if (err && err != ETIMEDOUT)
+		{
+			Logger::getLogger()->error("Email sendmail transport: write failed, %s", strerror(err));
+			res = CURLE_SEND_ERROR;
+		}
+
+		int status;
+		pid_t waited = err == ETIMEDOUT ? 0 : reap_child(pid, &status, limit);
+		if (waited == 0)
+		{
+			Logger::getLogger()->error("Email sendmail transport: %s did not take the message within %u seconds, killing it",
+					emailCfg->sendmail_path.c_str(), emailCfg->transfer_timeout);
+			kill(-pid, SIGKILL);
+			while (waitpid(pid, &status, 0) == -1 && errno == EINTR)
+				;
+			res = CURLE_OPERATION_TIMEDOUT;
+		}
+		else if (waited == -1)
+		{
+			// ECHILD if the host process ignores SIGCHLD
+			Logger::getLogger()->error("Email sendmail transport: unable to get the exit status of %s, %s",
+					emailCfg->sendmail_path.c_str(), strerror(errno));
+			res = CURLE_SEND_ERROR;
+		}
+		else if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+		{
+			Logger::getLogger()->error("Email sendmail transport: %s exited with status %d",
+					emailCfg->sendmail_path.c_str(),
+					WIFEXITED(status) ? WEXITSTATUS(status) : -1);
+			res = CURLE_SEND_ERROR;
+		}
+		if (err == EPIPE)
+		{
+			// Consume the pending SIGPIPE before unblocking it
+			struct timespec zero = { 0, 0 };
+			sigtimedwait(&pipeSet, NULL, &zero);
+		}
+	}
+	pthread_sigmask(SIG_SETMASK, &oldSet, NULL);
+
+	return res;
+}
+
+/**
+ * Create a directory if it does not already exist
+ */
+static bool ensure_dir(const char *dir, const char *sub)
+{
+	char path[PATH_MAX];
+	snprintf(path, sizeof(path), "%s%s", dir, sub);
+	if (mkdir(path, 0700) == -1 && errno != EEXIST)
+	{
+		Logger::getLogger()->error("Email maildir transport: unable to create %s, %s",
+				path, strerror(errno));
+		return false;
+	}
+	return true;
+}
+
+/**
+ * The host name used in maildir file names, looked up once
+ */
+static string maildir_host()
+{
+	char host[64];
+	if (gethostname(host, sizeof(host)) != 0)
+		strcpy(host, "localhost");
+	host[sizeof(host) - 1] = 0;
+	return string(host);
+}
+
+/**
+ * Create the maildir and its tmp, new and cur sub-directories if they
+ * do not exist. Called when the configuration is loaded so that
+ * delivering a message does not need to check the directories.
+ *
+ * @param emailCfg	The plugin configuration
+ * @return		True if the maildir is ready for use
+ */
+bool prepareMaildir(const EmailCfg *emailCfg)
+{
+	const char *dir = emailCfg->maildir_path.c_str();
+	return ensure_dir(dir, "") && ensure_dir(dir, "/tmp") && ensure_dir(dir, "/new")
+			&& ensure_dir(dir, "/cur");
+}
+
+/**
+ * Drop the message into a maildir. The message is written into tmp/
+ * and then atomically renamed into new/ so that a reader never sees
+ * a partial message. The maildir must have been created by
+ * prepareMaildir().
+ *
+ * @param emailCfg	The plugin configuration
+ * @param payload	The composed message
+ */
+int maildirMsg(const EmailCfg *emailCfg, const MessagePayload& payload)
+{
+	static atomic<unsigned int> sequence(0);
+	static const string host = maildir_host();
+
+	const char *dir = emailCfg->maildir_path.c_str();
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	char name[160];
+	snprintf(name, sizeof(name), "%ld.M%06ldP%dQ%u.%s", (long)tv.tv_sec, (long)tv.tv_usec,
+			(int)getpid(), sequence++, host.c_str());
+	char tmpName[PATH_MAX];
+	char newName[PATH_MAX];
+	snprintf(tmpName, sizeof(tmpName), "%s/tmp/%s", dir, name);
+	snprintf(newName, sizeof(newName), "%s/new/%s", dir, name);
+
+	char returnPath[320];
+	struct iovec iov[PAYLOAD_SEGMENTS + 1];
+	iov[0].iov_base = returnPath;
+	iov[0].iov_len = snprintf(returnPath, sizeof(returnPath), "Return-Path: <%s>\n",
+			emailCfg->email_from.c_str());
+	if (iov[0].iov_len >= sizeof(returnPath))
+		iov[0].iov_len = 0;
+	memcpy(&iov[1], payload.iov, sizeof(payload.iov));
+
+	int res = CURLE_OK;
+	int fd = open(tmpName, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+	if (fd == -1)
+	{
+		Logger::getLogger()->error("Email maildir transport: unable to create %s, %s",
+				tmpName, strerror(errno));
+		return CURLE_WRITE_ERROR;
+	}
+	int err = writev_all(fd, iov, PAYLOAD_SEGMENTS + 1, NULL);
+	if (err == 0 && fsync(fd) == -1)
+		err = errno;
+	close(fd);
+	if (err == 0 && rename(tmpName, newName) == -1)
+		err = errno;
+	if (err)
+	{
+		Logger::getLogger()->error("Email maildir transport: unable to write %s, %s",
+				newName, strerror(err));
+		unlink(tmpName);
+		res = CURLE_WRITE_ERROR;
+	}
+
+	return res;
+}
+
+};
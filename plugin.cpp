@@ -13,9 +13,13 @@
 #include <config_category.h>
 #include <logger.h>
 #include <email_config.h>
+#include <delivery_engine.h>
+#include <local_mail.h>
+#include <dkim_signer.h>
 #include <version.h>
 #include <string_utils.h>
 #include <regex>
+#include <cstring>
 
 
 #define PLUGIN_NAME "email"
@@ -159,12 +163,130 @@ static const char * def_cfg = QUOTE({
 		"displayName" : "Enabled",
 		"default": "false", 
 		"order" : "16",
-		"group" : "Headers" }
+		"group" : "Headers" },
+	"transport" : {
+		"description" : "How the email is handed on: SMTP to the mail server, piped to a local sendmail binary or written into a local maildir",
+		"type" : "enumeration",
+		"options" : [ "SMTP", "sendmail", "maildir" ],
+		"displayName" : "Transport",
+		"order" : "17",
+		"default" : "SMTP",
+		"group" : "Mail Server"
+		},
+	"sendmail_path" : {
+		"description" : "The sendmail compatible binary used by the sendmail transport",
+		"type" : "string",
+		"displayName" : "Sendmail Path",
+		"order" : "18",
+		"default" : "/usr/sbin/sendmail",
+		"group" : "Mail Server",
+		"validity" : "transport == \"sendmail\""
+		},
+	"maildir_path" : {
+		"description" : "The maildir or queue directory used by the maildir transport",
+		"type" : "string",
+		"displayName" : "Maildir Path",
+		"order" : "19",
+		"default" : "/var/spool/fledge/mail",
+		"group" : "Mail Server",
+		"validity" : "transport == \"maildir\""
+		},
+	"max_recipients" : {
+		"description" : "The maximum number of recipients sent in one SMTP transaction. Larger recipient lists are split into several transactions. Zero for no limit.",
+		"type" : "integer",
+		"displayName" : "Recipients Per Message",
+		"order" : "20",
+		"default" : "50",
+		"minimum" : "0",
+		"group" : "Mail Server",
+		"validity" : "transport == \"SMTP\""
+		},
+	"recorder_threshold" : {
+		"description" : "The number of consecutive delivery failures after which the record of recent deliveries is written to the log. Zero disables the automatic dump.",
+		"type" : "integer",
+		"displayName" : "Failure Dump Threshold",
+		"order" : "21",
+		"default" : "3",
+		"minimum" : "0",
+		"group" : "Diagnostics"
+		},
+	"recorder_dump" : {
+		"description" : "Write the record of recent deliveries to the log when this is changed from disabled to enabled. It stays enabled, disable it again before the next request.",
+		"type" : "boolean",
+		"displayName" : "Dump Delivery Record",
+		"order" : "22",
+		"default" : "false",
+		"group" : "Diagnostics"
+		},
+	"dkim_enable" : {
+		"description" : "Sign outgoing emails with DKIM",
+		"type" : "boolean",
+		"displayName" : "DKIM Signing",
+		"order" : "23",
+		"default" : "false",
+		"group" : "DKIM"
+		},
+	"dkim_domain" : {
+		"description" : "The signing domain, the d= tag of the signature",
+		"type" : "string",
+		"displayName" : "DKIM Domain",
+		"order" : "24",
+		"default" : "",
+		"group" : "DKIM",
+		"validity" : "dkim_enable == \"true\""
+		},
+	"dkim_selector" : {
+		"description" : "The selector of the public key in the signing domain's DNS, the s= tag of the signature",
+		"type" : "string",
+		"displayName" : "DKIM Selector",
+		"order" : "25",
+		"default" : "default",
+		"group" : "DKIM",
+		"validity" : "dkim_enable == \"true\""
+		},
+	"dkim_key_file" : {
+		"description" : "The PEM file holding the RSA private key used to sign emails",
+		"type" : "string",
+		"displayName" : "DKIM Private Key",
+		"order" : "26",
+		"default" : "",
+		"group" : "DKIM",
+		"validity" : "dkim_enable == \"true\""
+		},
+	"connect_timeout" : {
+		"description" : "The maximum time in seconds to wait for a connection to the SMTP server",
+		"type" : "integer",
+		"displayName" : "Connect Timeout",
+		"order" : "27",
+		"default" : "30",
+		"minimum" : "1",
+		"group" : "Mail Server",
+		"validity" : "transport == \"SMTP\""
+		},
+	"transfer_timeout" : {
+		"description" : "The maximum time in seconds allowed for an SMTP transaction, including the connection, or for handing a message to sendmail",
+		"type" : "integer",
+		"displayName" : "Transfer Timeout",
+		"order" : "28",
+		"default" : "120",
+		"minimum" : "1",
+		"group" : "Mail Server"
+		}
 	});
 
+#define JSON_VALUE_BUFFER	4096	// Parsed trigger reason values
+#define JSON_STACK_BUFFER	1024	// Trigger reason parser stack
+#define RENDER_RESERVE		1024	// Extra room for the macro expansions
+
 using namespace std;
 using namespace rapidjson;
 
+/**
+ * A JSON document whose values and parse stack are allocated from
+ * buffers owned by the plugin handle
+ */
+typedef GenericDocument<UTF8<>, MemoryPoolAllocator<>, MemoryPoolAllocator<> > ArenaDocument;
+
 /**
  * The Notification plugin interface
  */
@@ -186,10 +308,19 @@ typedef struct
 {
 	EmailCfg emailCfg;
 	bool isConfigValid;
+	DeliveryEngine *engine;
+	std::mutex configMutex;	// Guards emailCfg against reconfigure during delivery
+	unsigned int failures;	// Consecutive delivery failures
+	bool dumped;		// Flight recorder dumped for this run of failures
+	bool recorderDump;	// Last seen value of recorder_dump
+	DeliveryQueue queue;	// Messages waiting for the delivery engine
+	std::string subject;	// Rendered subject, reused between deliveries
+	std::string body;	// Rendered body, reused between deliveries
+	char jsonValues[JSON_VALUE_BUFFER];
+	char jsonStack[JSON_STACK_BUFFER];
 } PLUGIN_INFO;
 
 bool isAddressNamePairMatch = true;
-extern int sendEmailMsg(const EmailCfg *emailCfg, const char *msg);
 extern char *errorString(int result);
 
 /**
@@ -220,7 +351,18 @@ void resetConfig(EmailCfg *emailCfg)
 	emailCfg->use_ssl_tls = false;
 	emailCfg->username.clear();
 	emailCfg->password.clear();
-
+	emailCfg->transport = TRANSPORT_SMTP;
+	emailCfg->sendmail_path.clear();
+	emailCfg->maildir_path.clear();
+	emailCfg->max_recipients = 0;
+	emailCfg->connect_timeout = 0;
+	emailCfg->transfer_timeout = 0;
+	emailCfg->recorder_threshold = 0;
+	emailCfg->dkim_enable = false;
+	emailCfg->dkim_domain.clear();
+	emailCfg->dkim_selector.clear();
+	emailCfg->dkim_key_file.clear();
+	emailCfg->dkim = NULL;
 }
 
 /**
@@ -253,9 +395,9 @@ void printConfig(EmailCfg *emailCfg)
 						to.c_str(),
 						cc.c_str(),
 						bcc.c_str());
-	 Logger::getLogger()->info("server=%s, port=%d, subject=%s, body=%s use_ssl_tls=%s, username=%s, password=%s",
+	 Logger::getLogger()->info("server=%s, port=%d, subject=%s, body=%s use_ssl_tls=%s, username=%s, password=%s, transport=%d",
 						emailCfg->server.c_str(), emailCfg->port, emailCfg->subject.c_str(), emailCfg->email_body.c_str(),
-						emailCfg->use_ssl_tls?"true":"false", emailCfg->username.c_str(), emailCfg->password.c_str());
+						emailCfg->use_ssl_tls?"true":"false", emailCfg->username.c_str(), emailCfg->password.c_str(), emailCfg->transport);
 }
 
 /**
@@ -354,6 +496,56 @@ void parseConfig(ConfigCategory *config, EmailCfg *emailCfg)
 	{
 		emailCfg->password = config->getValue("password");
 	}
+	if (config->itemExists("transport"))
+	{
+		string transport = config->getValue("transport");
+		if (transport.compare("sendmail") == 0)
+			emailCfg->transport = TRANSPORT_SENDMAIL;
+		else if (transport.compare("maildir") == 0)
+			emailCfg->transport = TRANSPORT_MAILDIR;
+		else
+			emailCfg->transport = TRANSPORT_SMTP;
+	}
+	if (config->itemExists("sendmail_path"))
+	{
+		emailCfg->sendmail_path = StringStripWhiteSpacesAll(config->getValue("sendmail_path"));
+	}
+	if (config->itemExists("maildir_path"))
+	{
+		emailCfg->maildir_path = StringStripWhiteSpacesAll(config->getValue("maildir_path"));
+	}
+	if (config->itemExists("max_recipients"))
+	{
+		emailCfg->max_recipients = (unsigned int)atoi(config->getValue("max_recipients").c_str());
+	}
+	if (config->itemExists("connect_timeout"))
+	{
+		emailCfg->connect_timeout = (unsigned int)atoi(config->getValue("connect_timeout").c_str());
+	}
+	if (config->itemExists("transfer_timeout"))
+	{
+		emailCfg->transfer_timeout = (unsigned int)atoi(config->getValue("transfer_timeout").c_str());
+	}
+	if (config->itemExists("recorder_threshold"))
+	{
+		emailCfg->recorder_threshold = (unsigned int)atoi(config->getValue("recorder_threshold").c_str());
+	}
+	if (config->itemExists("dkim_enable"))
+	{
+		emailCfg->dkim_enable = config->getValue("dkim_enable").compare("true") ? false : true;
+	}
+	if (config->itemExists("dkim_domain"))
+	{
+		emailCfg->dkim_domain = StringStripWhiteSpacesAll(config->getValue("dkim_domain"));
+	}
+	if (config->itemExists("dkim_selector"))
+	{
+		emailCfg->dkim_selector = StringStripWhiteSpacesAll(config->getValue("dkim_selector"));
+	}
+	if (config->itemExists("dkim_key_file"))
+	{
+		emailCfg->dkim_key_file = StringStripWhiteSpacesAll(config->getValue("dkim_key_file"));
+	}
 
 	
 }
@@ -382,7 +574,25 @@ void validateConfig(PLUGIN_HANDLE *handle, EmailCfg *emailCfg)
 		Logger::getLogger()->error("Sender email address is missing");
 		return;
 	}
-	if (emailCfg->server.empty() || emailCfg->port == 0)
+	if (emailCfg->transport == TRANSPORT_SENDMAIL && emailCfg->sendmail_path.empty())
+	{
+		info->isConfigValid = false;
+		Logger::getLogger()->error("Sendmail path is missing");
+		return;
+	}
+	if (emailCfg->transport == TRANSPORT_MAILDIR && emailCfg->maildir_path.empty())
+	{
+		info->isConfigValid = false;
+		Logger::getLogger()->error("Maildir path is missing");
+		return;
+	}
+	if (emailCfg->transport == TRANSPORT_MAILDIR && !prepareMaildir(emailCfg))
+	{
+		info->isConfigValid = false;
+		Logger::getLogger()->error("Maildir %s cannot be used", emailCfg->maildir_path.c_str());
+		return;
+	}
+	if (emailCfg->transport == TRANSPORT_SMTP && (emailCfg->server.empty() || emailCfg->port == 0))
 	{
 		info->isConfigValid = false;
 		Logger::getLogger()->error("Invalid Email server/port configuration");
@@ -416,6 +626,100 @@ void validateConfig(PLUGIN_HANDLE *handle, EmailCfg *emailCfg)
 	}
 
 }
+/**
+ * Load the DKIM signer for the current configuration, replacing any
+ * previous one. Messages are sent unsigned if the signer cannot be
+ * loaded. No signer is loaded for an invalid configuration, which is
+ * not used to send messages.
+ */
+static void loadSigner(PLUGIN_INFO *info)
+{
+	EmailCfg *emailCfg = &info->emailCfg;
+	delete emailCfg->dkim;
+	emailCfg->dkim = NULL;
+	if (!emailCfg->dkim_enable || !info->isConfigValid)
+	{
+		return;
+	}
+	if (emailCfg->dkim_domain.empty() || emailCfg->dkim_selector.empty() || emailCfg->dkim_key_file.empty())
+	{
+		Logger::getLogger()->error("DKIM signing requires a domain, selector and private key, emails will not be signed");
+		return;
+	}
+	emailCfg->dkim = new DkimSigner(emailCfg);
+	if (!emailCfg->dkim->isValid())
+	{
+		Logger::getLogger()->error("DKIM signer could not be loaded, emails will not be signed");
+		delete emailCfg->dkim;
+		emailCfg->dkim = NULL;
+	}
+}
+
+/**
+ * Expand the macros in a subject or body template into a buffer that
+ * is reused between deliveries. $MESSAGE$ is only expanded when a
+ * message is given. If a DKIM signer is given the rendered text is
+ * added to its body hash as it is produced.
+ */
+static void renderTemplate(std::string& out, const std::string& tmpl,
+		const std::string& notificationName,
+		const char *reason, size_t reasonLen,
+		const std::string *message,
+		DkimSigner *dkim)
+{
+	static const char nameMacro[] = "$NOTIFICATION_INSTANCE_NAME$";
+	static const char reasonMacro[] = "$REASON$";
+	static const char messageMacro[] = "$MESSAGE$";
+
+	auto emit = [&out, dkim](const char *data, size_t len) {
+		out.append(data, len);
+		if (dkim)
+			dkim->bodyUpdate(data, len);
+	};
+
+	out.clear();
+	size_t pos = 0;
+	while (pos < tmpl.size())
+	{
+		size_t start = tmpl.find('$', pos);
+		if (start == std::string::npos)
+		{
+			emit(tmpl.data() + pos, tmpl.size() - pos);
+			break;
+		}
+		emit(tmpl.data() + pos, start - pos);
+		if (tmpl.compare(start, sizeof(nameMacro) - 1, nameMacro) == 0)
+		{
+			emit(notificationName.data(), notificationName.size());
+			pos = start + sizeof(nameMacro) - 1;
+		}
+		else if (tmpl.compare(start, sizeof(reasonMacro) - 1, reasonMacro) == 0)
+		{
+			emit(reason, reasonLen);
+			pos = start + sizeof(reasonMacro) - 1;
+		}
+		else if (message && tmpl.compare(start, sizeof(messageMacro) - 1, messageMacro) == 0)
+		{
+			emit(message->data(), message->size());
+			pos = start + sizeof(messageMacro) - 1;
+		}
+		else
+		{
+			emit("$", 1);
+			pos = start + 1;
+		}
+	}
+}
+
+/**
+ * Presize the buffers the subject and body are rendered into
+ */
+static void reserveBuffers(PLUGIN_INFO *info)
+{
+	info->subject.reserve(info->emailCfg.subject.size() + RENDER_RESERVE);
+	info->body.reserve(info->emailCfg.email_body.size() + RENDER_RESERVE);
+}
+
 /**
  * Initialise the plugin, called to get the plugin handle and setup the
  * plugin configuration
@@ -426,6 +730,9 @@ void validateConfig(PLUGIN_HANDLE *handle, EmailCfg *emailCfg)
 PLUGIN_HANDLE plugin_init(ConfigCategory* config)
 {
 	PLUGIN_INFO *info = new PLUGIN_INFO;
+	info->failures = 0;
+	info->dumped = false;
+	info->recorderDump = false;
 	
 	// Handle plugin configuration
 	if (config)
@@ -436,13 +743,18 @@ PLUGIN_HANDLE plugin_init(ConfigCategory* config)
 		parseConfig(config, &info->emailCfg);
 		printConfig(&info->emailCfg);
 		validateConfig((PLUGIN_HANDLE*)info,&info->emailCfg);
-		
+		loadSigner(info);
+		info->recorderDump = config->itemExists("recorder_dump")
+				&& config->getValue("recorder_dump").compare("true") == 0;
 	}
 	else
 	{
 		info->isConfigValid = false;
+		resetConfig(&info->emailCfg);
 		Logger::getLogger()->fatal("No config provided for email plugin");
 	}
+	info->engine = DeliveryEngine::acquire();
+	reserveBuffers(info);
 	
 	return (PLUGIN_HANDLE)info;
 }
@@ -462,12 +774,13 @@ bool plugin_deliver(PLUGIN_HANDLE handle,
                     const std::string& triggerReason,
                     const std::string& message)
 {
-	Logger::getLogger()->info("Email notification plugin_deliver(): deliveryName=%s, notificationName=%s, triggerReason=%s, message=%s",
-							deliveryName.c_str(), notificationName.c_str(), triggerReason.c_str(), message.c_str());
 	PLUGIN_INFO *info = (PLUGIN_INFO *) handle;
+	lock_guard<mutex> guard(info->configMutex);
 	
-	// Parse JSON triggerReason 
-	Document doc;
+	// Parse JSON triggerReason, using the handle's buffers rather than the heap
+	MemoryPoolAllocator<> valueAllocator(info->jsonValues, sizeof(info->jsonValues));
+	MemoryPoolAllocator<> stackAllocator(info->jsonStack, sizeof(info->jsonStack));
+	ArenaDocument doc(&valueAllocator, sizeof(info->jsonStack) / 2, &stackAllocator);
 	doc.Parse(triggerReason.c_str());
 	if (doc.HasParseError())
 	{
@@ -475,22 +788,26 @@ bool plugin_deliver(PLUGIN_HANDLE handle,
 		return false;
 	}
 	
-	// Replace Macros for subject
-	StringReplace(info->emailCfg.subject, "$NOTIFICATION_INSTANCE_NAME$", notificationName);
-	string reason = doc["reason"].GetString();
-
-	StringReplace(info->emailCfg.subject, "$REASON$", reason);
-
-	// Replace Macros for email body
-	std::string emailBody = info->emailCfg.email_body;
-	StringReplace(emailBody, "$MESSAGE$", message);
-	StringReplace(emailBody, "$REASON$", reason);
-	StringReplace(emailBody, "$NOTIFICATION_INSTANCE_NAME$", notificationName);
+	// Replace Macros for subject and email body
+	const char *reason = doc["reason"].GetString();
+	size_t reasonLen = doc["reason"].GetStringLength();
+	DkimSigner *dkim = info->emailCfg.dkim;
+	renderTemplate(info->subject, info->emailCfg.subject, notificationName, reason, reasonLen, NULL, NULL);
+	if (dkim)
+		dkim->bodyBegin();
+	renderTemplate(info->body, info->emailCfg.email_body, notificationName, reason, reasonLen, &message, dkim);
+	if (dkim)
+	{
+		// The payload trailer follows the body
+		const char *eol = payload_eol(&info->emailCfg);
+		dkim->bodyUpdate(eol, strlen(eol));
+		dkim->bodyEnd();
+	}
 
 	int rv = 0;
 	if (info->isConfigValid)
 	{
-		rv = sendEmailMsg(&info->emailCfg, emailBody.c_str());
+		rv = info->engine->submit(&info->queue, &info->emailCfg, info->subject.c_str(), info->body.c_str());
 	}
 	else
 	{
@@ -500,12 +817,21 @@ bool plugin_deliver(PLUGIN_HANDLE handle,
 
 	if (rv)
 	{
-		Logger::getLogger()->error("Email notification failed: sendEmailMsg() returned %d, %s", rv, errorString(rv));
+		Logger::getLogger()->error("Email notification failed: delivery returned %d, %s", rv, errorString(rv));
+		// The threshold may be changed part way through a run of failures
+		++info->failures;
+		if (info->emailCfg.recorder_threshold > 0 && !info->dumped
+				&& info->failures >= info->emailCfg.recorder_threshold)
+		{
+			info->engine->dumpRecorder("consecutive failure threshold reached");
+			info->dumped = true;
+		}
 		return false;
 	}
 	else
 	{
-		Logger::getLogger()->info("sendEmailMsg() returned SUCCESS");
+		info->failures = 0;
+		info->dumped = false;
 		return true;
 	}
 }
@@ -520,8 +846,22 @@ void plugin_reconfigure(PLUGIN_HANDLE *handle, string& newConfig)
 	ConfigCategory  config("new", newConfig); 
 	Logger::getLogger()->info("Email plugin reconfig=%s", newConfig.c_str());
 
+	lock_guard<mutex> guard(info->configMutex);
 	parseConfig(&config, &info->emailCfg);
 	validateConfig(handle,&info->emailCfg);
+	loadSigner(info);
+	reserveBuffers(info);
+	if (config.itemExists("recorder_dump"))
+	{
+		// The item cannot be reset by the plugin, so only a change
+		// from disabled to enabled requests a dump
+		bool dump = config.getValue("recorder_dump").compare("true") == 0;
+		if (dump && !info->recorderDump)
+		{
+			info->engine->dumpRecorder("requested by reconfiguration");
+		}
+		info->recorderDump = dump;
+	}
 	
 	
 	return;
@@ -533,6 +873,8 @@ void plugin_reconfigure(PLUGIN_HANDLE *handle, string& newConfig)
 void plugin_shutdown(PLUGIN_HANDLE *handle)
 {
 	PLUGIN_INFO *info = (PLUGIN_INFO *) handle;
+	DeliveryEngine::release();
+	delete info->emailCfg.dkim;
 	delete info;
 }
 
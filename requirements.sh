@@ -32,8 +32,10 @@ if [[ ( $os_name == *"Red Hat"* || $os_name == *"CentOS"* ) &&  $os_version == *
 	sudo yum -y install libcurl
 	sudo yum -y install curl-devel
 	sudo yum -y install libcurl-devel
+	sudo yum -y install openssl-devel
 elif apt --version 2>/dev/null; then
 	sudo apt -y install libcurl4-openssl-dev
+	sudo apt -y install libssl-dev
 else
 	echo "Requirements cannot be automatically installed, please refer README.rst to install requirements manually"
 fi
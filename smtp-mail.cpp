@@ -22,83 +22,125 @@
 
 #include <iostream>
 #include <cstring>
+#include <cctype>
+#include <cstdio>
 #include <vector>
 #include <ctime>
 #include <curl/curl.h>
 #include <email_config.h>
+#include <smtp_mail.h>
+#include <dkim_signer.h>
 #include <logger.h>
 #include "string_utils.h"
 
 using namespace std;
 
 extern "C" {
-	
-struct upload_status {
-  int lines_read;
-  vector<std::string>* payload;
-};
 
-char *getCurrTime()
+/**
+ * Append a header line of "name <address>" pairs. An address without
+ * a name is added as "<address>".
+ */
+void compose_address_header(std::string& header, const char *field,
+		const vector<std::string>& addrs, const vector<std::string>& names,
+		const char *eol)
 {
-	time_t rawtime;
-	struct tm * timeinfo;
-	static char buffer[80];
-
-	time (&rawtime);
-	timeinfo = localtime (&rawtime);
-
-	strftime (buffer, 80, "%a, %e %G %X %z", timeinfo);
-	return buffer;
+	header.append(field);
+	for(size_t i = 0; i < addrs.size(); i++ )
+	{
+		if (i > 0)
+		{
+			header.append(",");
+		}
+		if (i < names.size())
+		{
+			header.append(names[i]).append(" ");
+		}
+		header.append("<").append(addrs[i]).append(">");
+	}
+	header.append(" ").append(eol);
 }
 
+/**
+ * Append the From header line
+ */
+void compose_from_header(std::string& header, const EmailCfg *emailCfg, const char *eol)
+{
+	header.append("From: ").append(emailCfg->email_from_name).append(" <").append(emailCfg->email_from).append("> ").append(eol);
+}
 
-void compose_payload(vector<std::string>* &payload, const EmailCfg *emailCfg, const char* msg)
+/**
+ * Compose the message into the payload. The header buffer keeps its
+ * capacity so that, once it has grown to fit, composing a message
+ * makes no allocations.
+ *
+ * The header lines end in CRLF for SMTP. The local transports hand the
+ * message to software that expects local LF line endings, as used by
+ * the rendered body, so for them the header lines end in LF.
+ *
+ * @param payload	The payload to compose into
+ * @param emailCfg	The plugin configuration
+ * @param subject	The rendered subject
+ * @param msg		The rendered body, referenced rather than copied
+ */
+void compose_payload(MessagePayload& payload, const EmailCfg *emailCfg, const char *subject, const char *msg)
 {
-	payload->push_back("Date: " + string(getCurrTime()) + "\r\n");
+	std::string& header = payload.header;
+	const char *eol = payload_eol(emailCfg);
+	time_t rawtime;
+	struct tm timeinfo;
+	char date[80];
+
+	time (&rawtime);
+	localtime_r (&rawtime, &timeinfo);
+	strftime (date, sizeof(date), "%a, %e %G %X %z", &timeinfo);
+
+	header.clear();
+	header.append("Date: ").append(date).append(eol);
 	
 	// Parse address and name to compose CC pairs for payload
 	
 	if (emailCfg->email_to.size())
 	{
-		std::string ToList = {"To: "};
-		for(int i = 0; i < emailCfg->email_to.size(); i++ )
-		{
-			if (i > 0)
-			{
-				ToList.append(",");
-			}
-			ToList.append(emailCfg->email_to_name[i] + " <" + emailCfg->email_to[i] + ">");
-		}
-		ToList.append(" \r\n");
-		payload->push_back(ToList);
-		
+		compose_address_header(header, "To: ", emailCfg->email_to, emailCfg->email_to_name, eol);
 	}
 	
 	if (emailCfg->email_cc.size())
 	{
-		std::string CCList = {"CC: "};
-		for(int i = 0; i < emailCfg->email_cc.size(); i++ )
-		{
-			if (i > 0)
-			{
-				CCList.append(",");
-			}
-			CCList.append(emailCfg->email_cc_name[i] + " <" + emailCfg->email_cc[i] + ">");
-		}
-		CCList.append(" \r\n");
-		payload->push_back(CCList);
-		
+		compose_address_header(header, "CC: ", emailCfg->email_cc, emailCfg->email_cc_name, eol);
 	}
 	
 	// Do not add BCC payload otherwise it will be visible to all the recipients
 	
-	payload->push_back("From: " + emailCfg->email_from_name + " <" + emailCfg->email_from + "> \r\n");
-	payload->push_back("Subject: " + emailCfg->subject + "\r\n");
-	payload->push_back("\r\n");
-	payload->push_back(msg);
-	payload->push_back("\r\n");
+	compose_from_header(header, emailCfg, eol);
+	header.append("Subject: ").append(subject).append(eol);
+	header.append(eol);
+
+	// The body hash has already been computed as the body was rendered
+	if (!emailCfg->dkim || !emailCfg->dkim->sign(date, subject, eol, payload.signature))
+	{
+		payload.signature.clear();
+	}
+
+	payload.iov[PAYLOAD_SIGNATURE].iov_base = (void *)payload.signature.data();
+	payload.iov[PAYLOAD_SIGNATURE].iov_len = payload.signature.size();
+	payload.iov[PAYLOAD_HEADER].iov_base = (void *)header.data();
+	payload.iov[PAYLOAD_HEADER].iov_len = header.size();
+	payload.iov[PAYLOAD_BODY].iov_base = (void *)msg;
+	payload.iov[PAYLOAD_BODY].iov_len = strlen(msg);
+	payload.iov[PAYLOAD_TRAILER].iov_base = (void *)eol;
+	payload.iov[PAYLOAD_TRAILER].iov_len = strlen(eol);
+	payload.size = 0;
+	for (int i = 0; i < PAYLOAD_SEGMENTS; i++)
+	{
+		payload.size += payload.iov[i].iov_len;
+	}
 }
 
+/**
+ * Supply the next part of the payload to curl. A segment longer than
+ * curl's buffer is sent over several calls.
+ */
 static size_t payload_source(void *ptr, size_t size, size_t nmemb, void *userp)
 {
 	struct upload_status *upload_ctx = (struct upload_status *)userp;
@@ -107,32 +149,88 @@ static size_t payload_source(void *ptr, size_t size, size_t nmemb, void *userp)
 	return 0;
 	}
 
-	if (upload_ctx->lines_read >= upload_ctx->payload->size())
-		return 0;
+	upload_ctx->started = true;
 
-	std::string s = (*upload_ctx->payload)[upload_ctx->lines_read];
-
-	size_t len = s.length();
-	memcpy(ptr, s.c_str(), len);
-	upload_ctx->payload->erase(upload_ctx->payload->begin()+upload_ctx->lines_read);
+	while (upload_ctx->segment < PAYLOAD_SEGMENTS)
+	{
+		const struct iovec& seg = upload_ctx->payload->iov[upload_ctx->segment];
+		size_t len = seg.iov_len - upload_ctx->offset;
+		if (len == 0)
+		{
+			upload_ctx->segment++;
+			upload_ctx->offset = 0;
+			continue;
+		}
+		if (len > size * nmemb)
+			len = size * nmemb;
+		memcpy(ptr, (const char *)seg.iov_base + upload_ctx->offset, len);
+		upload_ctx->offset += len;
+		return len;
+	}
 
-	return len;
+	return 0;
 }
 
-int sendEmailMsg(const EmailCfg *emailCfg, const char *msg)
+/**
+ * Watch the SMTP conversation to capture the reply to each RCPT TO.
+ * libcurl sends the RCPT commands one at a time and waits for each
+ * reply, so replies are matched to recipients in order. The first
+ * recipient refused with the enhanced status code 4.5.3, too many
+ * recipients, is noted. A 452 reply without it may be for some other
+ * reason, such as a lack of storage on the relay.
+ *
+ * This needs verbose mode, which makes libcurl format its informational
+ * messages and call this for every block of the message it sends. It is
+ * therefore only used for transactions with more than one recipient.
+ */
+static int smtp_trace(CURL *curl, curl_infotype type, char *data, size_t size, void *userp)
 {
-  CURL *curl;
-  CURLcode res = CURLE_OK;
-  struct curl_slist *recipients = NULL;
-  struct upload_status upload_ctx;
+	SmtpTransaction *txn = (SmtpTransaction *)userp;
 
-  upload_ctx.lines_read = 0;
-  
-  upload_ctx.payload = new vector<std::string>;
-  compose_payload(upload_ctx.payload, emailCfg, msg);
+	if (type == CURLINFO_HEADER_OUT)
+	{
+		if (size >= 8 && strncasecmp(data, "RCPT TO:", 8) == 0)
+			txn->sent++;
+	}
+	else if (type == CURLINFO_HEADER_IN)
+	{
+		// Only the final line of a multi-line reply has a space after the code
+		if (txn->answered < txn->sent && txn->answered < txn->codes.size()
+				&& size >= 4 && data[3] != '-'
+				&& isdigit((unsigned char)data[0]) && isdigit((unsigned char)data[1])
+				&& isdigit((unsigned char)data[2]))
+		{
+			int code = (data[0] - '0') * 100 + (data[1] - '0') * 10 + (data[2] - '0');
+			if (code == 452 && txn->tooMany == txn->rcpts.size()
+					&& size >= 9 && strncmp(data + 4, "4.5.3", 5) == 0)
+			{
+				txn->tooMany = txn->answered;
+			}
+			txn->codes[txn->answered++] = code;
+		}
+	}
+	return 0;
+}
+
+/**
+ * Set up the curl handle of a transaction to send the payload to the
+ * transaction's recipients. The curl handle, payload and recipient
+ * list are supplied by the caller, the handle is not performed.
+ */
+void setupEmailMsg(SmtpTransaction *txn, const EmailCfg *emailCfg)
+{
+	CURL *curl = txn->curl;
 
-  curl = curl_easy_init();
-  if(curl) {
+	txn->recipients = NULL;
+	txn->upload.segment = PAYLOAD_SIGNATURE;
+	txn->upload.offset = 0;
+	txn->upload.started = false;
+	txn->codes.assign(txn->rcpts.size(), 0);
+	txn->sent = 0;
+	txn->answered = 0;
+	txn->tooMany = txn->rcpts.size();
+	txn->result = CURLE_OK;
+	txn->reply = 0;
 
 	if(emailCfg->use_ssl_tls)
 	{
@@ -141,11 +239,15 @@ int sendEmailMsg(const EmailCfg *emailCfg, const char *msg)
 		curl_easy_setopt(curl, CURLOPT_PASSWORD, emailCfg->password.c_str());
 	}
 	
-    /* This is the URL for your mailserver */
-	string proto = "";
-	if (emailCfg->server.find("smtp://") == std::string::npos) proto = "smtp://";
-	string server_url = proto + emailCfg->server + ":" + to_string(emailCfg->port);
-    curl_easy_setopt(curl, CURLOPT_URL, server_url.c_str());
+	/* This is the URL for your mailserver, curl copies the string
+	 * options so the scratch buffer is reused for each of them */
+	char port[16];
+	snprintf(port, sizeof(port), ":%u", emailCfg->port);
+	std::string& scratch = txn->scratch;
+	scratch.clear();
+	if (emailCfg->server.find("smtp://") == std::string::npos) scratch.append("smtp://");
+	scratch.append(emailCfg->server).append(port);
+	curl_easy_setopt(curl, CURLOPT_URL, scratch.c_str());
 
 	/* We'll start with a plain text connection, and upgrade     
 	 * to Transport Layer Security (TLS) using the STARTTLS command. */
@@ -153,67 +255,70 @@ int sendEmailMsg(const EmailCfg *emailCfg, const char *msg)
 	{
 		curl_easy_setopt(curl, CURLOPT_USE_SSL, (long)CURLUSESSL_ALL);   
 		//curl_easy_setopt(curl, CURLOPT_CAINFO, "/path/to/certificate.pem");
-	 }
-	
-    string email_from = "<" + emailCfg->email_from + ">";
-    curl_easy_setopt(curl, CURLOPT_MAIL_FROM, email_from.c_str());
+	}
 	
-    // Parse CC and BCC list to append recipients
+	scratch.assign("<").append(emailCfg->email_from).append(">");
+	curl_easy_setopt(curl, CURLOPT_MAIL_FROM, scratch.c_str());
 	
-	if (emailCfg->email_to.size())
+	for (auto rcpt : txn->rcpts)
 	{
-		for(auto it =  emailCfg->email_to.begin(); it != emailCfg->email_to.end(); it++ )
-		{
-			string email_to = "<" + *it + ">";
-			recipients = curl_slist_append(recipients, email_to.c_str() );
-		}
+		scratch.assign("<").append(*rcpt).append(">");
+		txn->recipients = curl_slist_append(txn->recipients, scratch.c_str());
 	}
+	curl_easy_setopt(curl, CURLOPT_MAIL_RCPT, txn->recipients);
+	/* Deliver to the accepted recipients even if some are rejected */
+#if LIBCURL_VERSION_NUM >= 0x080200
+	curl_easy_setopt(curl, CURLOPT_MAIL_RCPT_ALLOWFAILS, 1L);
+#elif LIBCURL_VERSION_NUM >= 0x074500
+	curl_easy_setopt(curl, CURLOPT_MAIL_RCPT_ALLLOWFAILS, 1L);
+#endif
 
-	if (emailCfg->email_cc.size())
+	/* Do not let an unresponsive server hold a shared delivery worker */
+	curl_easy_setopt(curl, CURLOPT_CONNECTTIMEOUT, (long)emailCfg->connect_timeout);
+	curl_easy_setopt(curl, CURLOPT_TIMEOUT, (long)emailCfg->transfer_timeout);
+	curl_easy_setopt(curl, CURLOPT_NOSIGNAL, 1L);
+
+	/* We're using a callback function to specify the payload (the headers and
+	 * body of the message). You could just use the CURLOPT_READDATA option to
+	 * specify a FILE pointer to read from. */
+	curl_easy_setopt(curl, CURLOPT_READFUNCTION, payload_source);
+	curl_easy_setopt(curl, CURLOPT_READDATA, &txn->upload);
+	curl_easy_setopt(curl, CURLOPT_UPLOAD, 1L);
+
+	/* The reply to each RCPT is only needed to tell recipients apart,
+	 * with one recipient the result of the transaction is enough. The
+	 * debug callback is only called in verbose mode, it does not print
+	 * anything itself */
+	if (txn->rcpts.size() > 1)
 	{
-		for(auto it =  emailCfg->email_cc.begin(); it != emailCfg->email_cc.end(); it++ )
-		{
-			string email_cc = "<" + *it + ">";
-			recipients = curl_slist_append(recipients, email_cc.c_str() );
-		}
+		curl_easy_setopt(curl, CURLOPT_DEBUGFUNCTION, smtp_trace);
+		curl_easy_setopt(curl, CURLOPT_DEBUGDATA, txn);
+		curl_easy_setopt(curl, CURLOPT_VERBOSE, 1L);
 	}
+	curl_easy_setopt(curl, CURLOPT_PRIVATE, txn);
+}
 
-	if (emailCfg->email_bcc.size())
+/**
+ * Release the resources used by a transaction once it has been
+ * performed. The curl handle remains owned by the caller.
+ */
+void finishEmailMsg(SmtpTransaction *txn)
+{
+	if (txn->curl)
 	{
-		for(auto it =  emailCfg->email_bcc.begin(); it != emailCfg->email_bcc.end(); it++ )
-		{
-			string email_bcc = "<" + *it + ">";
-			recipients = curl_slist_append(recipients, email_bcc.c_str() );
-		}
+		curl_easy_getinfo(txn->curl, CURLINFO_RESPONSE_CODE, &txn->reply);
+	}
+	if (txn->curl && txn->rcpts.size() == 1)
+	{
+		/* Not traced, libcurl reports a rejected command, RCPT among
+		 * them, as a send error and keeps the server's reply */
+		long code = txn->result == CURLE_SEND_ERROR ? txn->reply : 0;
+		txn->codes[0] = txn->result == CURLE_OK ? 250 : (int)code;
 	}
 
-    curl_easy_setopt(curl, CURLOPT_MAIL_RCPT, recipients);
-
-    /* We're using a callback function to specify the payload (the headers and
-     * body of the message). You could just use the CURLOPT_READDATA option to
-     * specify a FILE pointer to read from. */
-    curl_easy_setopt(curl, CURLOPT_READFUNCTION, payload_source);
-    curl_easy_setopt(curl, CURLOPT_READDATA, &upload_ctx);
-    curl_easy_setopt(curl, CURLOPT_UPLOAD, 1L);
-
-    //curl_easy_setopt(curl, CURLOPT_VERBOSE, 1L);
-
-    /* Send the message */
-    res = curl_easy_perform(curl);
-
-    /* Check for errors */
-    if(res != CURLE_OK)
-      fprintf(stderr, "curl_easy_perform() failed: %s\n",
-              curl_easy_strerror(res));
-
-    /* Free the list of recipients */
-    curl_slist_free_all(recipients);
-	
-    curl_easy_cleanup(curl);
-  }
-
-  delete upload_ctx.payload;
-  return (int)res;
+	/* Free the list of recipients */
+	curl_slist_free_all(txn->recipients);
+	txn->recipients = NULL;
 }
 
 const char *errorString(int result)
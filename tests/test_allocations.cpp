@@ -0,0 +1,443 @@
+/*
+ * Fledge "email" notification plugin.
+ *
+ * Check that, once warmed up, delivering a notification makes no heap
+ * allocations outside of libcurl, and that signing it with DKIM makes
+ * no more than DKIM_ALLOCATIONS allocations in OpenSSL.
+ *
+ * malloc and friends are replaced with counting versions, operator new
+ * uses malloc so C++ allocations are counted too. libcurl is given its
+ * own allocator with curl_global_init_mem, before the plugin initialises
+ * libcurl, and that allocator is not counted. OpenSSL is given an
+ * allocator that is counted separately. The loopback SMTP relay the
+ * deliveries are sent to runs in threads that are not counted.
+ *
+ * Copyright (c) 2026 Dianomic Systems
+ *
+ * Released under the Apache 2.0 Licence
+ *
+ */
+#include <plugin_api.h>
+#include <config_category.h>
+#include <curl/curl.h>
+#include <openssl/crypto.h>
+#include <openssl/evp.h>
+#include <openssl/pem.h>
+#include <openssl/rsa.h>
+#include <atomic>
+#include <thread>
+#include <string>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#define WARM_UP_DELIVERIES	40	// Grows the buffers of every worker
+#define COUNTED_DELIVERIES	50
+#define RECIPIENTS		10
+#define RECIPIENTS_PER_TXN	3	// Splits each SMTP message into 4 transactions
+#define DKIM_ALLOCATIONS	32	// OpenSSL allocations allowed to sign a message
+
+using namespace std;
+
+extern "C" {
+void *__libc_malloc(size_t size);
+void *__libc_calloc(size_t nmemb, size_t size);
+void *__libc_realloc(void *ptr, size_t size);
+void __libc_free(void *ptr);
+
+PLUGIN_HANDLE plugin_init(ConfigCategory *config);
+bool plugin_deliver(PLUGIN_HANDLE handle, const string& deliveryName,
+		const string& notificationName, const string& triggerReason,
+		const string& message);
+void plugin_shutdown(PLUGIN_HANDLE *handle);
+};
+
+static atomic<long> allocations(0);
+static atomic<long> opensslAllocations(0);
+static thread_local bool relayThread = false;
+
+/**
+ * Counting replacements for the C allocator
+ */
+extern "C" void *malloc(size_t size)
+{
+	if (!relayThread)
+		allocations++;
+	return __libc_malloc(size);
+}
+
+extern "C" void *calloc(size_t nmemb, size_t size)
+{
+	if (!relayThread)
+		allocations++;
+	return __libc_calloc(nmemb, size);
+}
+
+extern "C" void *realloc(void *ptr, size_t size)
+{
+	if (!relayThread)
+		allocations++;
+	return __libc_realloc(ptr, size);
+}
+
+extern "C" void free(void *ptr)
+{
+	__libc_free(ptr);
+}
+
+/**
+ * The allocator given to libcurl, which is not counted
+ */
+static void *curlMalloc(size_t size)
+{
+	return __libc_malloc(size);
+}
+
+static void curlFree(void *ptr)
+{
+	__libc_free(ptr);
+}
+
+static void *curlRealloc(void *ptr, size_t size)
+{
+	return __libc_realloc(ptr, size);
+}
+
+static char *curlStrdup(const char *str)
+{
+	size_t len = strlen(str) + 1;
+	char *copy = (char *)__libc_malloc(len);
+	if (copy)
+		memcpy(copy, str, len);
+	return copy;
+}
+
+static void *curlCalloc(size_t nmemb, size_t size)
+{
+	return __libc_calloc(nmemb, size);
+}
+
+/**
+ * The allocator given to OpenSSL, counted apart from the others
+ */
+static void *opensslMalloc(size_t size, const char *file, int line)
+{
+	if (!relayThread)
+		opensslAllocations++;
+	return __libc_malloc(size);
+}
+
+static void *opensslRealloc(void *ptr, size_t size, const char *file, int line)
+{
+	if (!relayThread)
+		opensslAllocations++;
+	return __libc_realloc(ptr, size);
+}
+
+static void opensslFree(void *ptr, const char *file, int line)
+{
+	__libc_free(ptr);
+}
+
+/**
+ * Write a reply to the SMTP client
+ */
+static void relayReply(int fd, const char *reply)
+{
+	if (write(fd, reply, strlen(reply)) < 0)
+		perror("relay write");
+}
+
+/**
+ * One SMTP session of the loopback relay, every command is accepted
+ */
+static void relaySession(int fd)
+{
+	relayThread = true;
+	char buf[8192];
+	size_t len = 0;
+	bool data = false;
+
+	relayReply(fd, "220 relay ready\r\n");
+	while (true)
+	{
+		char *eol;
+		while ((eol = (char *)memchr(buf, '\n', len)) == NULL)
+		{
+			if (len == sizeof(buf))
+				len = 0;	// A long body line, not needed
+			ssize_t n = read(fd, buf + len, sizeof(buf) - len);
+			if (n <= 0)
+			{
+				close(fd);
+				return;
+			}
+			len += n;
+		}
+		size_t lineLen = eol - buf;
+		if (lineLen > 0 && buf[lineLen - 1] == '\r')
+			lineLen--;
+
+		if (data)
+		{
+			if (lineLen == 1 && buf[0] == '.')
+			{
+				data = false;
+				relayReply(fd, "250 queued\r\n");
+			}
+		}
+		else if (strncasecmp(buf, "EHLO", 4) == 0)
+		{
+			relayReply(fd, "250-relay\r\n250 8BITMIME\r\n");
+		}
+		else if (strncasecmp(buf, "DATA", 4) == 0)
+		{
+			data = true;
+			relayReply(fd, "354 end with .\r\n");
+		}
+		else if (strncasecmp(buf, "QUIT", 4) == 0)
+		{
+			relayReply(fd, "221 bye\r\n");
+			close(fd);
+			return;
+		}
+		else
+		{
+			relayReply(fd, "250 ok\r\n");
+		}
+		len -= eol + 1 - buf;
+		memmove(buf, eol + 1, len);
+	}
+}
+
+/**
+ * Accept connections to the loopback relay until the socket is shut down
+ */
+static void relayAccept(int listenFd)
+{
+	relayThread = true;
+	while (true)
+	{
+		int fd = accept(listenFd, NULL, NULL);
+		if (fd < 0)
+			return;
+		thread(relaySession, fd).detach();
+	}
+}
+
+/**
+ * A configuration item with the given value
+ */
+static string item(const char *name, const char *type, const string& value)
+{
+	return string("\"") + name + "\" : { \"description\" : \"" + name
+		+ "\", \"type\" : \"" + type + "\", \"default\" : \"" + value
+		+ "\", \"value\" : \"" + value + "\" }";
+}
+
+/**
+ * The plugin configuration for a delivery to RECIPIENTS recipients
+ */
+static string configuration(const string& transport, unsigned short port, const string& dir,
+		bool dkim = false)
+{
+	string to, toName;
+	for (int i = 0; i < RECIPIENTS; i++)
+	{
+		to.append(i ? "," : "").append("user").append(to_string(i)).append("@example.com");
+		toName.append(i ? "," : "").append("User ").append(to_string(i));
+	}
+	return "{ " + item("email_to", "string", to)
+		+ ", " + item("email_to_name", "string", toName)
+		+ ", " + item("email_cc", "string", "")
+		+ ", " + item("email_cc_name", "string", "")
+		+ ", " + item("email_bcc", "string", "")
+		+ ", " + item("email_bcc_name", "string", "")
+		+ ", " + item("email_from", "string", "alerts@example.com")
+		+ ", " + item("email_from_name", "string", "Alerts")
+		+ ", " + item("subject", "string", "$NOTIFICATION_INSTANCE_NAME$ alert")
+		+ ", " + item("email_body", "string", "Reason: $REASON$, $MESSAGE$")
+		+ ", " + item("server", "string", "127.0.0.1")
+		+ ", " + item("port", "integer", to_string(port))
+		+ ", " + item("use_ssl_tls", "boolean", "false")
+		+ ", " + item("username", "string", "")
+		+ ", " + item("password", "password", "")
+		+ ", " + item("transport", "enumeration", transport)
+		+ ", " + item("sendmail_path", "string", dir + "/sendmail")
+		+ ", " + item("maildir_path", "string", dir + "/maildir")
+		+ ", " + item("max_recipients", "integer", to_string(RECIPIENTS_PER_TXN))
+		+ ", " + item("connect_timeout", "integer", "5")
+		+ ", " + item("transfer_timeout", "integer", "10")
+		+ ", " + item("recorder_threshold", "integer", "0")
+		+ ", " + item("dkim_enable", "boolean", dkim ? "true" : "false")
+		+ ", " + item("dkim_domain", "string", "example.com")
+		+ ", " + item("dkim_selector", "string", "alerts")
+		+ ", " + item("dkim_key_file", "string", dir + "/dkim.pem")
+		+ " }";
+}
+
+/**
+ * Deliver notifications through one plugin instance and count the
+ * allocations made by the deliveries after the warm up
+ *
+ * @param opensslLimit	The OpenSSL allocations allowed for each delivery
+ * @return		True if there were no failures, no allocations
+ *			and no more OpenSSL allocations than allowed
+ */
+static bool check(const char *name, const string& config, long opensslLimit = 0)
+{
+	ConfigCategory category("email", config);
+	PLUGIN_HANDLE handle = plugin_init(&category);
+
+	const string deliveryName("email");
+	const string notificationName("tank");
+	const string triggerReason("{ \"reason\" : \"triggered\" }");
+	const string message("level low");
+
+	int failures = 0;
+	for (int i = 0; i < WARM_UP_DELIVERIES; i++)
+	{
+		if (!plugin_deliver(handle, deliveryName, notificationName, triggerReason, message))
+			failures++;
+	}
+	allocations = 0;
+	opensslAllocations = 0;
+	for (int i = 0; i < COUNTED_DELIVERIES; i++)
+	{
+		if (!plugin_deliver(handle, deliveryName, notificationName, triggerReason, message))
+			failures++;
+	}
+	long counted = allocations;
+	long opensslCounted = opensslAllocations;
+
+	plugin_shutdown((PLUGIN_HANDLE *)handle);
+
+	printf("%s: %d failed deliveries, %ld allocations and %ld OpenSSL allocations in %d deliveries\n",
+			name, failures, counted, opensslCounted, COUNTED_DELIVERIES);
+	return failures == 0 && counted == 0
+		&& opensslCounted <= opensslLimit * COUNTED_DELIVERIES;
+}
+
+/**
+ * Create a sendmail replacement that discards the message
+ */
+static bool createSendmail(const string& dir)
+{
+	string path = dir + "/sendmail";
+	FILE *fp = fopen(path.c_str(), "w");
+	if (!fp)
+		return false;
+	fputs("#!/bin/sh\ncat > /dev/null\n", fp);
+	fclose(fp);
+	return chmod(path.c_str(), 0700) == 0;
+}
+
+/**
+ * Create an RSA key for DKIM signing
+ */
+static bool createKey(const string& dir)
+{
+	EVP_PKEY *pkey = NULL;
+	EVP_PKEY_CTX *ctx = EVP_PKEY_CTX_new_id(EVP_PKEY_RSA, NULL);
+	if (!ctx || EVP_PKEY_keygen_init(ctx) <= 0
+			|| EVP_PKEY_CTX_set_rsa_keygen_bits(ctx, 2048) <= 0
+			|| EVP_PKEY_keygen(ctx, &pkey) <= 0)
+	{
+		EVP_PKEY_CTX_free(ctx);
+		return false;
+	}
+	EVP_PKEY_CTX_free(ctx);
+
+	string path = dir + "/dkim.pem";
+	FILE *fp = fopen(path.c_str(), "w");
+	bool written = fp && PEM_write_PrivateKey(fp, pkey, NULL, NULL, 0, NULL, NULL);
+	if (fp)
+		fclose(fp);
+	EVP_PKEY_free(pkey);
+	return written;
+}
+
+/**
+ * Remove the files created for the test
+ */
+static void removeFiles(const string& dir)
+{
+	static const char *subdirs[] = { "/maildir/new", "/maildir/cur", "/maildir/tmp", "/maildir" };
+	for (auto sub : subdirs)
+	{
+		string path = dir + sub;
+		DIR *d = opendir(path.c_str());
+		if (d)
+		{
+			struct dirent *entry;
+			while ((entry = readdir(d)) != NULL)
+			{
+				if (entry->d_name[0] != '.')
+					unlink((path + "/" + entry->d_name).c_str());
+			}
+			closedir(d);
+		}
+		rmdir(path.c_str());
+	}
+	unlink((dir + "/sendmail").c_str());
+	unlink((dir + "/dkim.pem").c_str());
+	rmdir(dir.c_str());
+}
+
+int main(int argc, char **argv)
+{
+	// Before libcurl, which may use OpenSSL, is initialised
+	if (!CRYPTO_set_mem_functions(opensslMalloc, opensslRealloc, opensslFree))
+	{
+		fprintf(stderr, "Unable to replace the OpenSSL allocator\n");
+		return 1;
+	}
+	if (curl_global_init_mem(CURL_GLOBAL_DEFAULT, curlMalloc, curlFree,
+				curlRealloc, curlStrdup, curlCalloc) != CURLE_OK)
+	{
+		fprintf(stderr, "Unable to initialise libcurl\n");
+		return 1;
+	}
+
+	int listenFd = socket(AF_INET, SOCK_STREAM, 0);
+	struct sockaddr_in addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	addr.sin_port = 0;
+	socklen_t addrLen = sizeof(addr);
+	if (listenFd < 0 || bind(listenFd, (struct sockaddr *)&addr, sizeof(addr)) < 0
+			|| listen(listenFd, 16) < 0
+			|| getsockname(listenFd, (struct sockaddr *)&addr, &addrLen) < 0)
+	{
+		perror("Unable to start the loopback relay");
+		return 1;
+	}
+	thread relay(relayAccept, listenFd);
+
+	char dir[] = "/tmp/fledge-email-XXXXXX";
+	if (!mkdtemp(dir) || !createSendmail(dir) || !createKey(dir))
+	{
+		perror("Unable to create the test files");
+		return 1;
+	}
+
+	bool ok = check("sendmail", configuration("sendmail", 0, dir));
+	ok = check("maildir", configuration("maildir", 0, dir)) && ok;
+	ok = check("SMTP", configuration("SMTP", ntohs(addr.sin_port), dir)) && ok;
+	ok = check("SMTP with DKIM", configuration("SMTP", ntohs(addr.sin_port), dir, true),
+			DKIM_ALLOCATIONS) && ok;
+
+	shutdown(listenFd, SHUT_RDWR);
+	relay.join();
+	close(listenFd);
+	removeFiles(dir);
+
+	return ok ? 0 : 1;
+}